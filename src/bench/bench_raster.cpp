@@ -0,0 +1,204 @@
+#ifdef _WIN32
+#define _USE_MATH_DEFINES
+#endif
+#include "renderer/rasterizer/rasterizer.h"
+#include "world/camera.h"
+#include "world/model.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cxxopts.hpp>
+#include <iostream>
+#include <limits>
+#include <omp.h>
+#include <sstream>
+
+
+// Renders turntables of the bundled scenes at several resolutions and prints the
+// rasterizer throughput as JSON. Missing scenes are reported in `skipped`.
+
+struct scene_result
+{
+	std::string scene;
+	unsigned width;
+	unsigned height;
+	std::vector<double> frame_ms;
+	cg::renderer::raster_statistics statistics;
+};
+
+struct bounding_sphere
+{
+	float3 center;
+	float radius;
+};
+
+static bounding_sphere get_bounding_sphere(const cg::world::model& model)
+{
+	auto& vertices = *model.get_merged_vertex_buffer();
+	float3 min_corner{std::numeric_limits<float>::max()};
+	float3 max_corner{std::numeric_limits<float>::lowest()};
+	for (size_t i = 0; i < vertices.count(); ++i) {
+		min_corner = min(min_corner, vertices.item(i).position);
+		max_corner = max(max_corner, vertices.item(i).position);
+	}
+	return {(min_corner + max_corner) * 0.5f, std::max(length(max_corner - min_corner) * 0.5f, 1e-3f)};
+}
+
+static float4x4 get_turntable_matrix(const cg::world::model& model, const bounding_sphere& bounds, unsigned width, unsigned height, float angle)
+{
+	const float3 center = bounds.center;
+	const float radius = bounds.radius;
+
+	// The bounding sphere fits the 60 degree view with a small margin
+	float distance = 1.2f * radius / std::sin(float(M_PI) / 6.f);
+	cg::world::camera camera;
+	camera.set_width(float(width));
+	camera.set_height(float(height));
+	camera.set_position(center + float3{0.f, 0.f, distance});
+	camera.set_angle_of_view(60.f);
+	camera.set_z_near(std::max(distance - 2.f * radius, distance * 1e-3f));
+	camera.set_z_far(distance + 2.f * radius);
+
+	return mul(
+			camera.get_projection_matrix(),
+			camera.get_view_matrix(),
+			linalg::translation_matrix(center),
+			linalg::rotation_matrix(linalg::rotation_quat(float3{0.f, 1.f, 0.f}, angle)),
+			linalg::translation_matrix(-center),
+			model.get_world_matrix());
+}
+
+static scene_result run_scene(const std::string& name, const cg::world::model& model, unsigned width, unsigned height, unsigned frames)
+{
+	auto render_target = std::make_shared<cg::resource<cg::unsigned_color>>(width, height);
+	auto depth_buffer = std::make_shared<cg::resource<float>>(width, height);
+	cg::renderer::rasterizer<cg::vertex, cg::unsigned_color> rasterizer;
+	rasterizer.set_viewport(width, height);
+	rasterizer.set_render_target(render_target, depth_buffer);
+	rasterizer.set_vertex_buffer(model.get_merged_vertex_buffer());
+	rasterizer.set_index_buffer(model.get_merged_index_buffer());
+	rasterizer.pixel_shader = [](const cg::vertex& vertex_data, float) {
+		return cg::color::from_float3(vertex_data.ambient);
+	};
+
+	scene_result result{name, width, height, {}, {}};
+	// Bounds are found once, frames only rotate the model
+	const bounding_sphere bounds = get_bounding_sphere(model);
+	// The first frame allocates the arena and bins, it is not measured
+	for (unsigned frame = 0; frame <= frames; ++frame) {
+		float4x4 matrix = get_turntable_matrix(model, bounds, width, height, 2.f * float(M_PI) * float(frame) / float(frames));
+
+		auto start = std::chrono::high_resolution_clock::now();
+		rasterizer.clear_render_target({0, 0, 0});
+		rasterizer.set_transform(matrix);
+		rasterizer.multi_draw(model.get_draw_ranges());
+		rasterizer.resolve();
+		auto end = std::chrono::high_resolution_clock::now();
+
+		if (frame == 0) {
+			rasterizer.reset_statistics();
+			continue;
+		}
+		result.frame_ms.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+	}
+	result.statistics = rasterizer.get_statistics();
+	return result;
+}
+
+static double get_percentile(std::vector<double> values, double percentile)
+{
+	std::sort(values.begin(), values.end());
+	size_t rank = size_t(std::ceil(percentile / 100.0 * double(values.size())));
+	return values[std::clamp(rank, size_t(1), values.size()) - 1];
+}
+
+static std::string to_json(const std::vector<scene_result>& results, const std::vector<std::string>& skipped)
+{
+	std::ostringstream json;
+	json << "{\n  \"threads\": " << omp_get_max_threads() << ",\n  \"results\": [";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const auto& result = results[i];
+		const auto& statistics = result.statistics;
+		double total_ms = 0.0;
+		for (double ms: result.frame_ms) {
+			total_ms += ms;
+		}
+		double seconds = total_ms / 1000.0;
+		double depth_pass_rate = statistics.fragments ? double(statistics.depth_passed) / double(statistics.fragments) : 0.0;
+
+		json << (i ? "," : "") << "\n    {"
+			 << "\"scene\": \"" << result.scene << "\", "
+			 << "\"width\": " << result.width << ", "
+			 << "\"height\": " << result.height << ", "
+			 << "\"frames\": " << result.frame_ms.size() << ", "
+			 << "\"frame_ms\": {"
+			 << "\"mean\": " << total_ms / double(result.frame_ms.size()) << ", "
+			 << "\"p50\": " << get_percentile(result.frame_ms, 50.0) << ", "
+			 << "\"p90\": " << get_percentile(result.frame_ms, 90.0) << ", "
+			 << "\"p99\": " << get_percentile(result.frame_ms, 99.0) << "}, "
+			 << "\"vertices_per_s\": " << double(statistics.vertices) / seconds << ", "
+			 << "\"primitives_per_s\": " << double(statistics.primitives) / seconds << ", "
+			 << "\"triangles_per_s\": " << double(statistics.rasterized) / seconds << ", "
+			 << "\"fragments_per_s\": " << double(statistics.fragments) / seconds << ", "
+			 << "\"depth_pass_rate\": " << depth_pass_rate << "}";
+	}
+	json << "\n  ],\n  \"skipped\": [";
+	for (size_t i = 0; i < skipped.size(); ++i) {
+		json << (i ? ", " : "") << "\"" << skipped[i] << "\"";
+	}
+	json << "]\n}";
+	return json.str();
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		cxxopts::Options options(argv[0], "Rasterizer benchmark");
+		auto add_options = options.add_options();
+		add_options("models_folder", "Folder with the benchmark scenes", cxxopts::value<std::filesystem::path>()->default_value("models"));
+		add_options("frames", "Measured frames per scene and resolution", cxxopts::value<unsigned>()->default_value("30"));
+		add_options("h,help", "Print usage");
+		auto parsed = options.parse(argc, argv);
+		if (parsed.count("help")) {
+			std::cout << options.help() << std::endl;
+			return 0;
+		}
+		auto models_folder = parsed["models_folder"].as<std::filesystem::path>();
+		unsigned frames = std::max(parsed["frames"].as<unsigned>(), 1u);
+
+		const std::vector<std::pair<std::string, std::string>> scenes = {
+				{"cube", "cube.obj"},
+				{"cornell_box", "CornellBox-Original.obj"},
+				{"teapot", "teapot.obj"},
+				{"sponza", "sponza.obj"},
+		};
+		const std::vector<std::pair<unsigned, unsigned>> resolutions = {{640, 360}, {1280, 720}, {1920, 1080}};
+
+		std::vector<scene_result> results;
+		std::vector<std::string> skipped;
+		for (const auto& [name, file]: scenes) {
+			if (!std::filesystem::exists(models_folder / file)) {
+				std::cerr << "Skipping " << name << ": " << (models_folder / file).string() << " not found" << std::endl;
+				skipped.push_back(name);
+				continue;
+			}
+			cg::world::model model;
+			model.load_obj(models_folder / file);
+			for (const auto& [width, height]: resolutions) {
+				std::cerr << "Rendering " << name << " at " << width << "x" << height << std::endl;
+				results.push_back(run_scene(name, model, width, height, frames));
+			}
+		}
+
+		std::cout << to_json(results, skipped) << std::endl;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include "hybrid_renderer.h"
+
+#include "utils/resource_utils.h"
+
+#include <iostream>
+
+
+void cg::renderer::hybrid_renderer::init()
+{
+	ray_tracing_renderer::init();
+
+	depth_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height);
+	visibility_buffer = std::make_shared<cg::resource<cg::visibility>>(settings->width, settings->height);
+
+	rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
+	rasterizer->set_viewport(settings->width, settings->height);
+	rasterizer->set_render_target(nullptr, depth_buffer);
+	rasterizer->set_visibility_buffer(visibility_buffer);
+	// Traced triangles are double-sided
+	rasterizer->set_cull_mode(cg::renderer::cull_mode::none);
+}
+
+void cg::renderer::hybrid_renderer::render()
+{
+	raytracer->closest_hit_shader.tracer = raytracer.get();
+	raytracer->build_acceleration_structure();
+
+	rasterizer->set_transform(mul(
+			get_primary_projection(),
+			camera->get_view_matrix(),
+			model->get_world_matrix()));
+
+	auto start = std::chrono::high_resolution_clock::now();
+	rasterizer->clear_render_target({0, 0, 0});
+	for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); ++shape_id) {
+		rasterizer->set_draw_id(unsigned(shape_id));
+		rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
+		rasterizer->set_index_buffer(model->get_index_buffers()[shape_id]);
+		rasterizer->draw(model->get_index_buffers()[shape_id]->count(), 0);
+	}
+	rasterizer->resolve();
+	auto rasterized = std::chrono::high_resolution_clock::now();
+	std::cout << "Visibility rasterization took "
+			  << std::chrono::duration<float, std::milli>(rasterized - start).count() << " ms" << std::endl;
+
+	raytracer->clear_render_target({0, 0, 0});
+	raytracer->ray_generation(
+			camera->get_position(),
+			camera->get_direction(),
+			camera->get_right(),
+			camera->get_up(),
+			*visibility_buffer,
+			settings->raytracing_depth,
+			settings->accumulation_num);
+	auto stop = std::chrono::high_resolution_clock::now();
+	std::cout << "Secondary ray tracing took "
+			  << std::chrono::duration<float, std::milli>(stop - rasterized).count() << " ms" << std::endl;
+
+	cg::utils::save_resource(*render_target, settings->result_path);
+}
+
+float4x4 cg::renderer::hybrid_renderer::get_primary_projection() const
+{
+	// Ray `(x, y)` is `direction + u * right - v * up` with `u, v` spanning [-1, 1] over pixel
+	// centres `0..width - 1`, `u` scaled by the aspect ratio. The rasterizer puts pixel centre `x`
+	// at NDC `2 * x / width - 1`, so both axes get a scale and a half-pixel shift in view space.
+	const float width = float(settings->width);
+	const float height = float(settings->height);
+	const float right = length(camera->get_right());
+	const float up = length(camera->get_up());
+
+	float4x4 projection = camera->get_projection_matrix();
+	projection[0].x = (width - 1.f) * height / (width * width * right);
+	projection[1].y = (height - 1.f) / (height * up);
+	projection[2].x = 1.f / width;
+	projection[2].y = -1.f / height;
+	return projection;
+}
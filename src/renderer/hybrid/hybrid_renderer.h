@@ -0,0 +1,26 @@
+#pragma once
+
+#include "renderer/rasterizer/rasterizer.h"
+#include "renderer/raytracer/raytracer_renderer.h"
+#include "resource.h"
+
+
+namespace cg::renderer
+{
+	// Rasterizes primary visibility and traces only secondary rays from the visible surfaces
+	class hybrid_renderer : public ray_tracing_renderer
+	{
+	public:
+		virtual void init();
+		virtual void render();
+
+	protected:
+		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<cg::visibility>> visibility_buffer;
+
+		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+
+		// Projection whose pixel centres lie on the raytracer's primary rays
+		float4x4 get_primary_projection() const;
+	};
+}// namespace cg::renderer
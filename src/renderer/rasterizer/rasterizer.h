@@ -1,13 +1,23 @@
 #pragma once
 
 #include "resource.h"
+#include "utils/error_handler.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <limits>
 #include <linalg.h>
 #include <memory>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CG_RASTERIZER_SSE2
+#include <emmintrin.h>
+#endif
 
 
 using namespace linalg::aliases;
@@ -16,39 +26,378 @@ static constexpr float DEFAULT_DEPTH = std::numeric_limits<float>::max();
 
 namespace cg::renderer
 {
+	// Edge functions of `width` horizontally adjacent pixels, stepped incrementally along a row.
+	// Edge `i` at pixel (x, y) is `step_x[i] * x + step_y[i] * y + offset[i]`.
+	class edge_span
+	{
+	public:
+		static constexpr int width = 4;
+
+		edge_span() = default;
+		edge_span(const int3& step_x, const int3& step_y, const int3& offset, int x, int y);
+
+		void advance();
+		// Bit `i` is set when pixel `i` of the span is inside all three edges
+		int coverage() const;
+
+	protected:
+#ifdef CG_RASTERIZER_SSE2
+		__m128i value[3];
+		__m128i step[3];
+#else
+		int value[3][width];
+		int step[3];
+#endif
+	};
+
+	enum class block_coverage
+	{
+		outside,
+		inside,
+		partial
+	};
+
+	// Front faces are counter-clockwise on screen
+	enum class cull_mode
+	{
+		none,
+		back,
+		front
+	};
+
+	// Work done and discarded at every pipeline stage, accumulated over draws
+	struct raster_statistics
+	{
+		// Vertices referenced by the drawn ranges, once per instance
+		size_t vertices = 0;
+		size_t primitives = 0;
+		size_t frustum_culled = 0;
+		size_t face_culled = 0;
+		size_t zero_area_culled = 0;
+		size_t no_samples_culled = 0;
+		size_t rasterized = 0;
+		// Covered pixels that reached the depth test and the ones with at least one passing sample
+		size_t fragments = 0;
+		size_t depth_passed = 0;
+
+		raster_statistics& operator+=(const raster_statistics& other)
+		{
+			vertices += other.vertices;
+			primitives += other.primitives;
+			frustum_culled += other.frustum_culled;
+			face_culled += other.face_culled;
+			zero_area_culled += other.zero_area_culled;
+			no_samples_culled += other.no_samples_culled;
+			rasterized += other.rasterized;
+			fragments += other.fragments;
+			depth_passed += other.depth_passed;
+			return *this;
+		}
+	};
+
+	// Per-instance input of `draw_instanced`, plain draws see the identity transform
+	struct instance_data
+	{
+		float4x4 transform = linalg::identity;
+		// Free for the vertex shader, e.g. a tint or an animation phase
+		float4 attributes{0.f, 0.f, 0.f, 0.f};
+	};
+
+	// Outputs of `mrt_pixel_shader`: `color` goes to the render target, `targets[i]` to the target in slot `i`
+	static constexpr size_t max_output_targets = 4;
+	struct pixel_outputs
+	{
+		cg::color color{0.f, 0.f, 0.f};
+		float4 targets[max_output_targets];
+	};
+
+	// Clip-space vertex of a primitive being clipped, with barycentrics relative to the primitive
+	struct clip_vertex
+	{
+		float4 position;
+		float3 bary;
+	};
+
+	// Triangle after vertex processing, ready to be rasterized in any tile
+	struct raster_triangle
+	{
+		// Vertices of the source primitive for `get_shaded_vertex`, the first one is the provoking vertex
+		unsigned int vertex_ids[3];
+		float3 z;
+		// Screen positions in sub-pixel fixed point
+		int2 a;
+		int2 b;
+		int2 c;
+		float3 inv_w;
+		// Twice the screen area in fixed point units, zero for culled triangles
+		float edge;
+		// Columns are barycentrics of the triangle's vertices relative to the source primitive,
+		// the identity unless the primitive was clipped
+		float3x3 vertex_bary;
+		// Per-pixel depth gradient around vertex `a` and the depth range widened by `depth_margin`,
+		// for Hi-Z tests
+		float2 depth_gradient;
+		float depth_margin;
+		float min_z;
+		float max_z;
+
+		// Edge `i` at fixed point position (x, y) is `step_x[i] * x + step_y[i] * y + offset[i]`
+		int3 step_x;
+		int3 step_y;
+		int64_t offset[3];
+
+		int2 begin;
+		int2 end;
+		unsigned int primitive_id;
+	};
+
+	// Triangle edges rebased to the centre of a block's first pixel. Edges that accept every sample
+	// of the block are zeroed, the others are small there and fit 32-bit SIMD lanes.
+	struct raster_block
+	{
+		block_coverage coverage;
+		int3 step_x;
+		int3 step_y;
+		int3 offset;
+		// Unclipped edge values for barycentrics
+		float3 edge;
+	};
+
 	template<typename VB, typename RT>
 	class rasterizer
 	{
 	public:
 		rasterizer() {};
 		~rasterizer() {};
+		// Binding only a depth buffer selects the depth-only pipeline: vertex attributes are not kept,
+		// no shader runs and single-sampled depth is tested and written a span of pixels at a time
 		void set_render_target(
 				std::shared_ptr<resource<RT>> in_render_target,
 				std::shared_ptr<resource<float>> in_depth_buffer = nullptr);
+		// Clears are lazy: tiles receive the clear value when a draw first writes them,
+		// and `resolve` fills the untouched ones, so targets are up to date only after it
 		void clear_render_target(
 				const RT& in_clear_value, const float in_depth = DEFAULT_DEPTH);
 
+		// Binds an additional target written by `mrt_pixel_shader` in the same pass. Slot values are
+		// converted to `float`, `float2`, `float3`, `float4`, `cg::color` or `cg::unsigned_color`.
+		// Output targets are written once per pixel, are not multisampled and clear to zero.
+		template<typename T>
+		void set_output_target(size_t slot, std::shared_ptr<resource<T>> in_target);
+
+		void set_visibility_buffer(std::shared_ptr<resource<cg::visibility>> in_visibility_buffer);
+		void set_draw_id(unsigned int in_draw_id);
+
+		// In the visibility-buffer mode draws write only triangle IDs and depth, then
+		// `shade_visibility` runs `pixel_shader` once per covered pixel with attributes
+		// interpolated by an `interpolate(a, b, c, bary)` overload for `VB`.
+		// Draw IDs are assigned by the rasterizer, from zero after every clear. With multisampling
+		// the pixel colour goes to every sample that received depth and `resolve` blends the edges.
+		void set_visibility_shading(bool enabled);
+		void shade_visibility();
+
 		void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
+		void set_instance_buffer(std::shared_ptr<resource<instance_data>> in_instance_buffer);
 
 		void set_viewport(size_t in_width, size_t in_height);
+		void set_cull_mode(cull_mode in_cull_mode);
+
+		// Multisample anti-aliasing with 1, 2, 4 or 8 samples per pixel at the standard positions.
+		// Coverage and depth are kept per sample, pixels are shaded once per triangle, and
+		// `resolve` averages the samples into the render target and keeps the nearest depth.
+		void set_sample_count(unsigned int in_samples);
+		// Brings the render target, depth and visibility buffers up to date after drawing
+		void resolve();
+
+		const raster_statistics& get_statistics() const;
+		void reset_statistics();
+
+		// Used instead of `vertex_shader` when the shader is not set: positions are transformed
+		// by this matrix times the instance transform in SIMD batches and vertex data passes through
+		void set_transform(const float4x4& in_transform);
 
 		void draw(size_t num_vertexes, size_t vertex_offset);
+		// Draws the primitives once per instance of the bound instance buffer, starting at
+		// `first_instance`, as a single submission: vertices are shaded per instance, while
+		// setup, binning and tile rasterization run once for all of them in instance order.
+		// Primitive IDs of the visibility buffer count on across instances.
+		void draw_instanced(size_t num_vertexes, size_t instance_count, size_t vertex_offset, size_t first_instance = 0);
+		// Draws ranges of the bound buffers in order as a single submission, for models packed
+		// into one vertex and index pool. Primitive IDs of the visibility buffer count on across ranges.
+		void multi_draw(const std::vector<cg::draw_range>& in_ranges);
 
-		std::function<std::pair<float4, VB>(float4 vertex, VB vertex_data)> vertex_shader;
+		std::function<std::pair<float4, VB>(float4 vertex, VB vertex_data, const instance_data& instance)> vertex_shader;
 		std::function<cg::color(const VB& vertex_data, const float z)> pixel_shader;
+		// Used instead of `pixel_shader` when set: vertex data is interpolated perspective-correctly at
+		// the pixel and comes with its differences to the next pixel in x and y, e.g. for texture LOD.
+		// Both modes interpolate with an `interpolate(a, b, c, bary)` overload for `VB`.
+		std::function<cg::color(const VB& vertex_data, const VB& ddx, const VB& ddy, const float z)> interpolated_pixel_shader;
+		// Takes precedence over both pixel shaders above, with the inputs of `interpolated_pixel_shader`
+		std::function<pixel_outputs(const VB& vertex_data, const VB& ddx, const VB& ddy, const float z)> mrt_pixel_shader;
 
 	protected:
 		std::shared_ptr<cg::resource<VB>> vertex_buffer;
 		std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+		std::shared_ptr<cg::resource<instance_data>> instance_buffer;
 		std::shared_ptr<cg::resource<RT>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<cg::visibility>> visibility_buffer;
+		unsigned int draw_id = 0;
+
+		// Type-erased target of a slot with writers for its format
+		struct output_target
+		{
+			std::shared_ptr<void> target;
+			void (*write)(void* target, size_t x, size_t y, const float4& value) = nullptr;
+			void (*clear)(void* target, size_t x, size_t y, size_t count) = nullptr;
+		};
+		output_target output_targets[max_output_targets];
+
+		// Draw recorded in the visibility-buffer mode, keeps its post-transform vertices for shading
+		struct deferred_draw
+		{
+			std::shared_ptr<cg::resource<VB>> vertex_buffer;
+			std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+			std::vector<cg::draw_range> ranges;
+			std::vector<size_t> range_offsets;
+			size_t num_vertices;
+			std::vector<float> clip_x;
+			std::vector<float> clip_y;
+			std::vector<float> clip_z;
+			std::vector<float> clip_w;
+			std::vector<VB> shaded_vertices;
+		};
+		bool visibility_shading = false;
+		std::vector<deferred_draw> deferred_draws;
 
 		size_t width = 1920;
 		size_t height = 1080;
+		cull_mode cull = cull_mode::back;
+		raster_statistics statistics;
+
+		// Vertices are snapped to 1/16 of a pixel, sample offsets use the same grid
+		static constexpr int subpixel_bits = 4;
+		static constexpr int subpixel_scale = 1 << subpixel_bits;
+		static constexpr unsigned int max_samples = 8;
+		unsigned int samples = 1;
+		int2 sample_offsets[max_samples] = {int2{0, 0}};
+		int sample_extent = 0;
+		std::vector<RT> sample_colors;
+		std::vector<float> sample_depths;
+
+		float4x4 transform = linalg::identity;
+
+		// Ranges and instances of the current draw. Primitive `i` of the ranges starts at
+		// `range_offsets[i]`, primitives of instance `j` follow the ones of instance `j - 1`.
+		std::vector<cg::draw_range> ranges;
+		std::vector<size_t> range_offsets;
+		const instance_data* instances = nullptr;
+		size_t num_instances = 0;
+
+		struct primitive_location
+		{
+			size_t first_index;
+			size_t base_vertex;
+			size_t instance;
+		};
+
+		// Post-transform arena: every vertex of the bound buffer that the ranges reference is shaded once
+		// per instance of a draw, the copy of instance `i` starts at `i * vertex_buffer->count()`.
+		// Vertices are processed in batches, batches without a referenced vertex are skipped.
+		static constexpr int vertex_batch_size = 256;
+		std::vector<uint8_t> vertex_used;
+		std::vector<int> vertex_batches;
+		std::vector<float> clip_x;
+		std::vector<float> clip_y;
+		std::vector<float> clip_z;
+		std::vector<float> clip_w;
+		std::vector<VB> shaded_vertices;
+
+		// A vertex `p` is inside a plane when `dot(plane, p) >= 0`: primitives outside any of
+		// the frustum planes are rejected, the ones crossing the near or guard band planes are clipped.
+		// The guard band keeps screen coordinates small enough for the integer edge functions.
+		static constexpr int num_planes = 10;
+		static constexpr unsigned int frustum_planes = 0x03F;
+		static constexpr unsigned int clipping_planes = 0x3C1;
+		static constexpr int max_clip_vertices = 8;
+		static constexpr float guard_band = 8192.f;
+		float4 planes[num_planes];
+
+		// Triangles with a bounding box this small are tested for covered samples during setup
+		static constexpr int small_triangle_pixels = 16;
+
+		// Screen is split into square tiles that are rasterized in parallel,
+		// tiles are walked in blocks that are rejected or accepted as a whole
+		static constexpr int tile_size = 64;
+		static constexpr int block_size = 8;
+		size_t tiles_x = 0;
+		size_t tiles_y = 0;
+		std::vector<raster_triangle> triangles;
+		std::vector<unsigned int> triangle_offsets;
+		std::vector<std::vector<unsigned int>> tile_bins;
+
+		// Tiles cleared since their last write: their memory is stale and holds the clear values
+		std::vector<uint8_t> tile_cleared;
+		RT clear_value{};
+		float clear_depth = DEFAULT_DEPTH;
+
+		// Hi-Z pyramid over `depth_buffer`: nearest and farthest stored depth of every block and
+		// farthest of every tile. Triangles and blocks behind it are rejected before pixel work.
+		size_t blocks_x = 0;
+		size_t blocks_y = 0;
+		std::vector<float> block_min_depth;
+		std::vector<float> block_max_depth;
+		std::vector<float> tile_max_depth;
+		bool depth_pyramid_valid = false;
+
+		void submit();
+		static primitive_location locate_primitive(
+				const std::vector<cg::draw_range>& in_ranges, const std::vector<size_t>& in_range_offsets,
+				size_t primitive_id);
+		void process_vertices();
+		// Marks the vertices referenced by the current ranges and returns their count
+		size_t find_used_vertices();
+		const VB& get_shaded_vertex(unsigned int vertex_id);
+		void update_planes();
+		int clip_primitive(size_t vertex_id, size_t vertex_base, clip_vertex* polygon) const;
+		void setup_primitive(unsigned int primitive_id, raster_statistics& primitive_statistics);
+		bool setup_triangle(
+				raster_triangle& triangle, const clip_vertex& a, const clip_vertex& b, const clip_vertex& c,
+				raster_statistics& triangle_statistics);
+		bool covers_samples(const raster_triangle& triangle) const;
+		void update_tile_grid();
+		void fill_tile(size_t tile_id, bool resolved);
+		void bin_triangles();
+		void rasterize_tile(size_t tile_id, raster_statistics& tile_statistics);
+		block_coverage setup_block(const raster_triangle& triangle, int x, int y, raster_block& block) const;
+		bool shade_pixel(
+				const raster_triangle& triangle, int x, int y, float u, float v, float w,
+				unsigned int coverage, bool test_depth);
+		template<typename S>
+		auto shade_interpolated(const S& shader, const raster_triangle& triangle, const float3& weights, float depth);
+		void write_output_targets(size_t x, size_t y, const pixel_outputs& outputs);
+		template<typename T>
+		static void write_output(void* target, size_t x, size_t y, const float4& value);
+		template<typename T>
+		static void clear_output(void* target, size_t x, size_t y, size_t count);
+		float& get_sample_depth(int x, int y, unsigned int sample);
+		bool is_depth_only() const;
+		// Returns the mask of `mask` pixels that passed the depth test
+		int write_depth_span(
+				const raster_triangle& triangle, int x, int y, float dx, const float3& row_edge,
+				const float3& pixel_step, float inv_area, int mask, int lanes, bool test_depth);
+
+		void build_depth_pyramid();
+		void update_block_depth(int block_x, int block_y);
+		void update_tile_depth(size_t tile_id);
+		float2 get_depth_bounds(const raster_triangle& triangle, int2 begin, int2 end) const;
 
-		int edge_function(int2 a, int2 b, int2 c);
-		bool depth_test(float z, size_t x, size_t y);
+		void record_deferred_draw();
+		static float3 get_perspective_barycentrics(const float4 (&clip)[3], float2 ndc);
+
+		int64_t edge_function(int2 a, int2 b, int2 c);
+		bool depth_test(float z, size_t x, size_t y, unsigned int sample);
 	};
 
 	template<typename VB, typename RT>
@@ -58,6 +407,16 @@ namespace cg::renderer
 	{
 		render_target = in_render_target;
 		depth_buffer = in_depth_buffer;
+		depth_pyramid_valid = false;
+		tile_cleared.clear();
+		sample_colors.clear();
+		sample_depths.clear();
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_transform(const float4x4& in_transform)
+	{
+		transform = in_transform;
 	}
 
 	template<typename VB, typename RT>
@@ -65,24 +424,151 @@ namespace cg::renderer
 	{
 		width = in_width;
 		height = in_height;
+		depth_pyramid_valid = false;
+		tile_cleared.clear();
 	}
 
 	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::clear_render_target(const RT& in_clear_value, const float in_depth)
+	inline void rasterizer<VB, RT>::set_cull_mode(cull_mode in_cull_mode)
+	{
+		cull = in_cull_mode;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_sample_count(unsigned int in_samples)
 	{
-		if (render_target) {
-			for (size_t i = 0; i < render_target->count(); ++i) {
-				render_target->item(i) = in_clear_value;
+		// Standard sample patterns in 1/16 of a pixel around the pixel centre
+		static constexpr int pattern_2[2][2] = {{4, 4}, {-4, -4}};
+		static constexpr int pattern_4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+		static constexpr int pattern_8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+		const int(*pattern)[2] = nullptr;
+		switch (in_samples) {
+			case 1:
+				break;
+			case 2:
+				pattern = pattern_2;
+				break;
+			case 4:
+				pattern = pattern_4;
+				break;
+			case 8:
+				pattern = pattern_8;
+				break;
+			default:
+				THROW_ERROR("Unsupported number of samples");
+		}
+
+		samples = in_samples;
+		sample_extent = 0;
+		for (unsigned int sample = 0; sample < samples; ++sample) {
+			sample_offsets[sample] = pattern ? int2{pattern[sample][0], pattern[sample][1]} : int2{0, 0};
+			sample_extent = std::max(sample_extent, maxelem(abs(sample_offsets[sample])));
+		}
+		sample_colors.clear();
+		sample_depths.clear();
+		depth_pyramid_valid = false;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::resolve()
+	{
+		update_tile_grid();
+
+		const int num_tiles = int(tile_cleared.size());
+#pragma omp parallel for schedule(dynamic)
+		for (int tile_id = 0; tile_id < num_tiles; ++tile_id) {
+			// Untouched tiles resolve to the clear values without reading their samples
+			if (tile_cleared[tile_id]) {
+				fill_tile(size_t(tile_id), true);
+				continue;
+			}
+			if (samples == 1) {
+				continue;
+			}
+
+			const int tile_x = (tile_id % int(tiles_x)) * tile_size;
+			const int tile_y = (tile_id / int(tiles_x)) * tile_size;
+			const int tile_end_x = std::min(tile_x + tile_size, int(width));
+			const int tile_end_y = std::min(tile_y + tile_size, int(height));
+			for (int y = tile_y; y < tile_end_y; ++y) {
+				for (int x = tile_x; x < tile_end_x; ++x) {
+					const size_t pixel = size_t(y) * width + x;
+					if (render_target) {
+						render_target->item(x, y) = RT::average(&sample_colors[pixel * samples], samples);
+					}
+					if (depth_buffer) {
+						const float* depths = &sample_depths[pixel * samples];
+						depth_buffer->item(x, y) = *std::min_element(depths, depths + samples);
+					}
+				}
 			}
 		}
+	}
 
+	template<typename VB, typename RT>
+	inline const raster_statistics& rasterizer<VB, RT>::get_statistics() const
+	{
+		return statistics;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::reset_statistics()
+	{
+		statistics = raster_statistics{};
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::clear_render_target(const RT& in_clear_value, const float in_depth)
+	{
+		update_tile_grid();
+		clear_value = in_clear_value;
+		clear_depth = in_depth;
+		std::fill(tile_cleared.begin(), tile_cleared.end(), uint8_t(1));
+		deferred_draws.clear();
+
+		// The pyramid of a cleared target is known without reading it
 		if (depth_buffer) {
-			for (size_t i = 0; i < depth_buffer->count(); ++i) {
-				depth_buffer->item(i) = in_depth;
-			}
+			block_min_depth.assign(blocks_x * blocks_y, in_depth);
+			block_max_depth.assign(blocks_x * blocks_y, in_depth);
+			tile_max_depth.assign(tiles_x * tiles_y, in_depth);
+			depth_pyramid_valid = true;
 		}
 	}
 
+	template<typename VB, typename RT>
+	template<typename T>
+	inline void rasterizer<VB, RT>::set_output_target(size_t slot, std::shared_ptr<resource<T>> in_target)
+	{
+		if (slot >= max_output_targets) {
+			THROW_ERROR("Output target slot is out of range");
+		}
+
+		output_target& output = output_targets[slot];
+		output.target = in_target;
+		output.write = in_target ? &write_output<T> : nullptr;
+		output.clear = in_target ? &clear_output<T> : nullptr;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_visibility_buffer(
+			std::shared_ptr<resource<cg::visibility>> in_visibility_buffer)
+	{
+		visibility_buffer = in_visibility_buffer;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_draw_id(unsigned int in_draw_id)
+	{
+		draw_id = in_draw_id;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_visibility_shading(bool enabled)
+	{
+		visibility_shading = enabled;
+	}
+
 	template<typename VB, typename RT>
 	inline void rasterizer<VB, RT>::set_vertex_buffer(
 			std::shared_ptr<resource<VB>> in_vertex_buffer)
@@ -97,58 +583,249 @@ namespace cg::renderer
 		index_buffer = std::move(in_index_buffer);
 	}
 
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_instance_buffer(
+			std::shared_ptr<resource<instance_data>> in_instance_buffer)
+	{
+		instance_buffer = std::move(in_instance_buffer);
+	}
+
 	template<typename VB, typename RT>
 	inline void rasterizer<VB, RT>::draw(size_t num_vertexes, size_t vertex_offset)
 	{
-		size_t vertex_id = vertex_offset;
-		while (vertex_id < vertex_offset + num_vertexes) {
-			std::vector<VB> vertices(3);
-			vertices[0] = vertex_buffer->item(index_buffer->item(vertex_id++));
-			vertices[1] = vertex_buffer->item(index_buffer->item(vertex_id++));
-			vertices[2] = vertex_buffer->item(index_buffer->item(vertex_id++));
+		static const instance_data default_instance;
+		ranges.assign(1, cg::draw_range{vertex_offset, num_vertexes, 0});
+		instances = &default_instance;
+		num_instances = 1;
+		submit();
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::draw_instanced(
+			size_t num_vertexes, size_t instance_count, size_t vertex_offset, size_t first_instance)
+	{
+		if (!instance_buffer || first_instance + instance_count > instance_buffer->count()) {
+			THROW_ERROR("Instance range is outside of the instance buffer");
+		}
+		if (instance_count == 0) {
+			return;
+		}
+
+		ranges.assign(1, cg::draw_range{vertex_offset, num_vertexes, 0});
+		instances = &instance_buffer->item(first_instance);
+		num_instances = instance_count;
+		submit();
+	}
 
-			for (auto& vertex: vertices) {
-				float4 coords{vertex.position.x, vertex.position.y, vertex.position.z, 1.f};
-				auto processed_vertex = vertex_shader(coords, vertex);
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::multi_draw(const std::vector<cg::draw_range>& in_ranges)
+	{
+		static const instance_data default_instance;
+		ranges = in_ranges;
+		instances = &default_instance;
+		num_instances = 1;
+		submit();
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::submit()
+	{
+		range_offsets.resize(ranges.size() + 1);
+		range_offsets[0] = 0;
+		for (size_t range = 0; range < ranges.size(); ++range) {
+			range_offsets[range + 1] = range_offsets[range] + ranges[range].index_count / 3;
+		}
+		const int num_primitives = int(range_offsets.back() * num_instances);
+		if (num_primitives == 0) {
+			return;
+		}
 
-				vertex.position = processed_vertex.first.xyz() / processed_vertex.first.w;
-				vertex.position.x = (vertex.position.x + 1) * width / 2.f;
-				vertex.position.y = (-vertex.position.y + 1) * height / 2.f;
+		process_vertices();
+		update_planes();
+		if (visibility_shading) {
+			draw_id = unsigned(deferred_draws.size());
+		}
+
+		// Clipping turns a primitive into zero or more triangles, so their slots are counted first
+		const size_t num_vertices = vertex_buffer->count();
+		triangle_offsets.resize(num_primitives + 1);
+		triangle_offsets[0] = 0;
+
+#pragma omp parallel for
+		for (int primitive_id = 0; primitive_id < num_primitives; ++primitive_id) {
+			clip_vertex polygon[max_clip_vertices];
+			auto location = locate_primitive(ranges, range_offsets, size_t(primitive_id));
+			int count = clip_primitive(
+					location.first_index, location.instance * num_vertices + location.base_vertex, polygon);
+			triangle_offsets[primitive_id + 1] = std::max(count - 2, 0);
+		}
+
+		for (int primitive_id = 0; primitive_id < num_primitives; ++primitive_id) {
+			triangle_offsets[primitive_id + 1] += triangle_offsets[primitive_id];
+		}
+		triangles.resize(triangle_offsets[num_primitives]);
+
+#pragma omp parallel
+		{
+			raster_statistics thread_statistics;
+#pragma omp for
+			for (int primitive_id = 0; primitive_id < num_primitives; ++primitive_id) {
+				setup_primitive(unsigned(primitive_id), thread_statistics);
 			}
+#pragma omp critical
+			statistics += thread_statistics;
+		}
 
-			int2 vertex_a = int2(vertices[0].position.xy());
-			int2 vertex_b = int2(vertices[1].position.xy());
-			int2 vertex_c = int2(vertices[2].position.xy());
+		bin_triangles();
+		if (depth_buffer && !depth_pyramid_valid) {
+			build_depth_pyramid();
+		}
 
-			int2 min_vertex = min(vertex_a, min(vertex_b, vertex_c));
-			int2 max_vertex = max(vertex_a, max(vertex_b, vertex_c));
+		const int num_tiles = int(tile_bins.size());
+#pragma omp parallel
+		{
+			raster_statistics thread_statistics;
+#pragma omp for schedule(dynamic)
+			for (int tile_id = 0; tile_id < num_tiles; ++tile_id) {
+				rasterize_tile(size_t(tile_id), thread_statistics);
+			}
+#pragma omp critical
+			statistics += thread_statistics;
+		}
 
-			int2 min_viewport = int2{0, 0};
-			int2 max_viewport = int2{(int) width - 1, (int) height - 1};
+		if (visibility_shading) {
+			record_deferred_draw();
+		}
+	}
 
-			int2 begin = clamp(min_vertex, min_viewport, max_viewport);
-			int2 end = clamp(max_vertex, min_viewport, max_viewport);
+	template<typename VB, typename RT>
+	inline typename rasterizer<VB, RT>::primitive_location rasterizer<VB, RT>::locate_primitive(
+			const std::vector<cg::draw_range>& in_ranges, const std::vector<size_t>& in_range_offsets,
+			size_t primitive_id)
+	{
+		const size_t instance_primitives = in_range_offsets.back();
+		const size_t local_id = primitive_id % instance_primitives;
+		// Empty ranges share their offset with the next one, so the last range starting at or before the primitive holds it
+		const size_t range = size_t(std::upper_bound(in_range_offsets.begin(), in_range_offsets.end(), local_id) - in_range_offsets.begin()) - 1;
+		return primitive_location{
+				in_ranges[range].index_offset + 3 * (local_id - in_range_offsets[range]),
+				in_ranges[range].base_vertex,
+				primitive_id / instance_primitives};
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::record_deferred_draw()
+	{
+		// The arena is handed over to the record, the next draw allocates a new one
+		deferred_draw record;
+		record.vertex_buffer = vertex_buffer;
+		record.index_buffer = index_buffer;
+		record.ranges = ranges;
+		record.range_offsets = range_offsets;
+		record.num_vertices = vertex_buffer->count();
+		record.clip_x = std::move(clip_x);
+		record.clip_y = std::move(clip_y);
+		record.clip_z = std::move(clip_z);
+		record.clip_w = std::move(clip_w);
+		if (vertex_shader) {
+			record.shaded_vertices = std::move(shaded_vertices);
+		}
+		deferred_draws.push_back(std::move(record));
 
-			auto edge = float(edge_function(vertex_a, vertex_b, vertex_c));
+		clip_x.clear();
+		clip_y.clear();
+		clip_z.clear();
+		clip_w.clear();
+		shaded_vertices.clear();
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::shade_visibility()
+	{
+		if (!visibility_buffer || !visibility_shading) {
+			return;
+		}
+
+		update_tile_grid();
+
+		const int num_tiles = int(tile_cleared.size());
+#pragma omp parallel for schedule(dynamic)
+		for (int tile_id = 0; tile_id < num_tiles; ++tile_id) {
+			// Nothing was drawn into cleared tiles
+			if (tile_cleared[tile_id]) {
+				continue;
+			}
 
-			for (int x = begin.x; x <= end.x; ++x) {
-				for (int y = begin.y; y < end.y; ++y) {
-					int2 point{x, y};
-					int edge0 = edge_function(vertex_a, vertex_b, point);
-					int edge1 = edge_function(vertex_b, vertex_c, point);
-					int edge2 = edge_function(vertex_c, vertex_a, point);
+			const int tile_x = (tile_id % int(tiles_x)) * tile_size;
+			const int tile_y = (tile_id / int(tiles_x)) * tile_size;
+			const int tile_end_x = std::min(tile_x + tile_size, int(width));
+			const int tile_end_y = std::min(tile_y + tile_size, int(height));
+			for (int y = tile_y; y < tile_end_y; ++y) {
+				for (int x = tile_x; x < tile_end_x; ++x) {
+					auto& sample = visibility_buffer->item(x, y);
+					if (sample.primitive_id == cg::visibility::invalid_id) {
+						continue;
+					}
 
-					if (0 <= edge0 && 0 <= edge1 && 0 <= edge2) {
-						auto u = float(edge1) / edge;
-						auto v = float(edge2) / edge;
-						auto w = float(edge0) / edge;
+					const auto& record = deferred_draws[sample.draw_id];
+					auto location = locate_primitive(record.ranges, record.range_offsets, sample.primitive_id);
+					const size_t instance_base = location.instance * record.num_vertices;
+					unsigned int ids[3];
+					float4 clip[3];
+					for (size_t i = 0; i < 3; ++i) {
+						ids[i] = unsigned(location.base_vertex + record.index_buffer->item(location.first_index + i));
+						const size_t arena_id = instance_base + ids[i];
+						clip[i] = float4{record.clip_x[arena_id], record.clip_y[arena_id], record.clip_z[arena_id], record.clip_w[arena_id]};
+						if (!record.shaded_vertices.empty()) {
+							ids[i] = unsigned(arena_id);
+						}
+					}
 
-						float depth = u * vertices[0].position.z + v * vertices[1].position.z + w * vertices[2].position.z;
+					// Pixels are sampled at integer coordinates, see `setup_triangle`
+					float2 ndc{2.f * float(x) / float(width) - 1.f, 1.f - 2.f * float(y) / float(height)};
+					float3 bary = get_perspective_barycentrics(clip, ndc);
+					sample.bary = bary;
 
-						if (depth_test(depth, x, y)) {
-							auto pixel_result = pixel_shader(vertices[0], depth);
-							render_target->item(x, y) = RT::from_color(pixel_result);
-							depth_buffer->item(x, y) = depth;
+					if (render_target || mrt_pixel_shader) {
+						const VB* vertices = record.shaded_vertices.empty() ? record.vertex_buffer->get_data() : record.shaded_vertices.data();
+						const VB& a = vertices[ids[0]];
+						const VB& b = vertices[ids[1]];
+						const VB& c = vertices[ids[2]];
+						VB vertex = interpolate(a, b, c, bary);
+						float depth = depth_buffer && samples == 1 ? get_sample_depth(x, y, 0) : dot(bary, float3{clip[0].z, clip[1].z, clip[2].z}) / dot(bary, float3{clip[0].w, clip[1].w, clip[2].w});
+						cg::color pixel_result;
+						if (mrt_pixel_shader || interpolated_pixel_shader) {
+							const float2 pixel_size{2.f / float(width), -2.f / float(height)};
+							float3 bary_x = get_perspective_barycentrics(clip, ndc + float2{pixel_size.x, 0.f});
+							float3 bary_y = get_perspective_barycentrics(clip, ndc + float2{0.f, pixel_size.y});
+							VB ddx = interpolate(a, b, c, bary_x - bary);
+							VB ddy = interpolate(a, b, c, bary_y - bary);
+							if (mrt_pixel_shader) {
+								auto outputs = mrt_pixel_shader(vertex, ddx, ddy, depth);
+								write_output_targets(size_t(x), size_t(y), outputs);
+								pixel_result = outputs.color;
+							}
+							else {
+								pixel_result = interpolated_pixel_shader(vertex, ddx, ddy, depth);
+							}
+						}
+						else {
+							pixel_result = pixel_shader(vertex, depth);
+						}
+						if (render_target) {
+							RT color = RT::from_color(pixel_result);
+							if (samples == 1) {
+								render_target->item(x, y) = color;
+							}
+							else {
+								// Drawn samples are nearer than the clear depth, the others keep the clear colour
+								RT* colors = &sample_colors[(size_t(y) * width + x) * samples];
+								for (unsigned int sample = 0; sample < samples; ++sample) {
+									if (!depth_buffer || get_sample_depth(x, y, sample) < clear_depth) {
+										colors[sample] = color;
+									}
+								}
+							}
 						}
 					}
 				}
@@ -157,20 +834,1000 @@ namespace cg::renderer
 	}
 
 	template<typename VB, typename RT>
-	inline int
-	rasterizer<VB, RT>::edge_function(int2 a, int2 b, int2 c)
+	inline float3 rasterizer<VB, RT>::get_perspective_barycentrics(const float4 (&clip)[3], float2 ndc)
+	{
+		// Rows of the adjugate of [x y w] solve for weights of the pixel's view ray in homogeneous
+		// 2D, which stays valid for vertices behind the camera
+		float3 columns[3];
+		for (int i = 0; i < 3; ++i) {
+			columns[i] = float3{clip[i].x, clip[i].y, clip[i].w};
+		}
+
+		float3 p{ndc.x, ndc.y, 1.f};
+		float3 bary{
+				dot(cross(columns[1], columns[2]), p),
+				dot(cross(columns[2], columns[0]), p),
+				dot(cross(columns[0], columns[1]), p)};
+		return bary / (bary.x + bary.y + bary.z);
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::process_vertices()
+	{
+		statistics.vertices += find_used_vertices() * num_instances;
+
+		const int num_vertices = int(vertex_buffer->count());
+		const int num_arena_vertices = num_vertices * int(num_instances);
+		clip_x.resize(num_arena_vertices);
+		clip_y.resize(num_arena_vertices);
+		clip_z.resize(num_arena_vertices);
+		clip_w.resize(num_arena_vertices);
+
+		const int instance_batches = int(vertex_batches.size());
+		const int num_batches = instance_batches * int(num_instances);
+		if (vertex_shader) {
+			const bool keep_attributes = !is_depth_only();
+			if (keep_attributes) {
+				shaded_vertices.resize(num_arena_vertices);
+			}
+#pragma omp parallel for schedule(dynamic)
+			for (int batch = 0; batch < num_batches; ++batch) {
+				const int instance = batch / instance_batches;
+				const int first = vertex_batches[batch % instance_batches];
+				const int end = std::min(first + vertex_batch_size, num_vertices);
+				for (int vertex_id = first; vertex_id < end; ++vertex_id) {
+					if (!vertex_used[vertex_id]) {
+						continue;
+					}
+					const VB& vertex = vertex_buffer->item(vertex_id);
+					float4 coords{vertex.position.x, vertex.position.y, vertex.position.z, 1.f};
+					auto processed_vertex = vertex_shader(coords, vertex, instances[instance]);
+
+					const size_t arena_id = size_t(instance) * num_vertices + vertex_id;
+					clip_x[arena_id] = processed_vertex.first.x;
+					clip_y[arena_id] = processed_vertex.first.y;
+					clip_z[arena_id] = processed_vertex.first.z;
+					clip_w[arena_id] = processed_vertex.first.w;
+					if (keep_attributes) {
+						shaded_vertices[arena_id] = processed_vertex.second;
+					}
+				}
+			}
+			return;
+		}
+
+		// Positions are gathered into SoA batches, so the matrix multiply runs on SIMD lanes.
+		// Unreferenced vertices inside a batch are transformed too, that is cheaper than gathering.
+#pragma omp parallel for
+		for (int batch = 0; batch < num_batches; ++batch) {
+			const int instance = batch / instance_batches;
+			const int first = vertex_batches[batch % instance_batches];
+			const int count = std::min(vertex_batch_size, num_vertices - first);
+			const float4x4 m = mul(transform, instances[instance].transform);
+
+			float x[vertex_batch_size], y[vertex_batch_size], z[vertex_batch_size];
+			for (int i = 0; i < count; ++i) {
+				const float3& position = vertex_buffer->item(first + i).position;
+				x[i] = position.x;
+				y[i] = position.y;
+				z[i] = position.z;
+			}
+
+			const size_t arena_first = size_t(instance) * num_vertices + first;
+			float* out_x = clip_x.data() + arena_first;
+			float* out_y = clip_y.data() + arena_first;
+			float* out_z = clip_z.data() + arena_first;
+			float* out_w = clip_w.data() + arena_first;
+#pragma omp simd
+			for (int i = 0; i < count; ++i) {
+				out_x[i] = m[0].x * x[i] + m[1].x * y[i] + m[2].x * z[i] + m[3].x;
+				out_y[i] = m[0].y * x[i] + m[1].y * y[i] + m[2].y * z[i] + m[3].y;
+				out_z[i] = m[0].z * x[i] + m[1].z * y[i] + m[2].z * z[i] + m[3].z;
+				out_w[i] = m[0].w * x[i] + m[1].w * y[i] + m[2].w * z[i] + m[3].w;
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline size_t rasterizer<VB, RT>::find_used_vertices()
+	{
+		const int num_vertices = int(vertex_buffer->count());
+		vertex_used.assign(num_vertices, 0);
+		const int num_primitives = int(range_offsets.back());
+#pragma omp parallel for
+		for (int primitive_id = 0; primitive_id < num_primitives; ++primitive_id) {
+			auto location = locate_primitive(ranges, range_offsets, size_t(primitive_id));
+			for (size_t i = 0; i < 3; ++i) {
+				const size_t vertex_id = location.base_vertex + index_buffer->item(location.first_index + i);
+#pragma omp atomic write
+				vertex_used[vertex_id] = uint8_t(1);
+			}
+		}
+
+		vertex_batches.clear();
+		size_t num_used = 0;
+		for (int first = 0; first < num_vertices; first += vertex_batch_size) {
+			const auto begin = vertex_used.begin() + first;
+			const size_t used = size_t(std::count(begin, begin + std::min(vertex_batch_size, num_vertices - first), uint8_t(1)));
+			if (used) {
+				vertex_batches.push_back(first);
+				num_used += used;
+			}
+		}
+		return num_used;
+	}
+
+	template<typename VB, typename RT>
+	inline const VB& rasterizer<VB, RT>::get_shaded_vertex(unsigned int vertex_id)
+	{
+		return vertex_shader ? shaded_vertices[vertex_id] : vertex_buffer->item(vertex_id);
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::update_planes()
+	{
+		const float guard_x = guard_band * 2.f / float(width);
+		const float guard_y = guard_band * 2.f / float(height);
+
+		planes[0] = float4{0.f, 0.f, 1.f, 0.f};// near, z >= 0
+		planes[1] = float4{0.f, 0.f, -1.f, 1.f};// far, z <= w
+		planes[2] = float4{1.f, 0.f, 0.f, 1.f};
+		planes[3] = float4{-1.f, 0.f, 0.f, 1.f};
+		planes[4] = float4{0.f, 1.f, 0.f, 1.f};
+		planes[5] = float4{0.f, -1.f, 0.f, 1.f};
+		planes[6] = float4{1.f, 0.f, 0.f, guard_x};
+		planes[7] = float4{-1.f, 0.f, 0.f, guard_x};
+		planes[8] = float4{0.f, 1.f, 0.f, guard_y};
+		planes[9] = float4{0.f, -1.f, 0.f, guard_y};
+	}
+
+	template<typename VB, typename RT>
+	inline int rasterizer<VB, RT>::clip_primitive(size_t vertex_id, size_t vertex_base, clip_vertex* polygon) const
+	{
+		unsigned int outside_all = ~0u;
+		unsigned int outside_any = 0;
+		for (int i = 0; i < 3; ++i) {
+			size_t id = vertex_base + index_buffer->item(vertex_id + i);
+			polygon[i].position = float4{clip_x[id], clip_y[id], clip_z[id], clip_w[id]};
+			polygon[i].bary = float3{float(i == 0), float(i == 1), float(i == 2)};
+
+			unsigned int outcode = 0;
+			for (int plane = 0; plane < num_planes; ++plane) {
+				outcode |= unsigned(dot(planes[plane], polygon[i].position) < 0.f) << plane;
+			}
+			outside_all &= outcode;
+			outside_any |= outcode;
+		}
+
+		if (outside_all & frustum_planes) {
+			return 0;
+		}
+
+		// Sutherland-Hodgman against the crossed planes only, most primitives skip it entirely
+		int count = 3;
+		unsigned int clip_mask = outside_any & clipping_planes;
+		for (int plane = 0; plane < num_planes && count >= 3; ++plane) {
+			if (!(clip_mask & (1u << plane))) {
+				continue;
+			}
+
+			clip_vertex input[max_clip_vertices];
+			std::copy(polygon, polygon + count, input);
+			int input_count = count;
+			count = 0;
+
+			for (int i = 0; i < input_count; ++i) {
+				const clip_vertex& current = input[i];
+				const clip_vertex& next = input[(i + 1) % input_count];
+				float current_distance = dot(planes[plane], current.position);
+				float next_distance = dot(planes[plane], next.position);
+
+				if (current_distance >= 0.f) {
+					polygon[count++] = current;
+				}
+				if ((current_distance >= 0.f) != (next_distance >= 0.f)) {
+					// Always interpolate from the inside vertex, so edges shared by neighbours get the same point
+					const clip_vertex& inside = current_distance >= 0.f ? current : next;
+					const clip_vertex& outside = current_distance >= 0.f ? next : current;
+					float inside_distance = dot(planes[plane], inside.position);
+					float outside_distance = dot(planes[plane], outside.position);
+					float t = inside_distance / (inside_distance - outside_distance);
+
+					polygon[count].position = lerp(inside.position, outside.position, t);
+					polygon[count].bary = lerp(inside.bary, outside.bary, t);
+					++count;
+				}
+			}
+		}
+		return count >= 3 ? count : 0;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::setup_primitive(unsigned int primitive_id, raster_statistics& primitive_statistics)
+	{
+		const size_t num_vertices = vertex_buffer->count();
+		auto location = locate_primitive(ranges, range_offsets, primitive_id);
+		const size_t vertex_id = location.first_index;
+		clip_vertex polygon[max_clip_vertices];
+		int count = clip_primitive(vertex_id, location.instance * num_vertices + location.base_vertex, polygon);
+		// Without a vertex shader every instance shares the data of the vertex buffer
+		const size_t shaded_base = (vertex_shader ? location.instance * num_vertices : 0) + location.base_vertex;
+
+		++primitive_statistics.primitives;
+		if (count == 0) {
+			++primitive_statistics.frustum_culled;
+		}
+
+		// The clipped polygon is convex, so it is split into a fan around its first vertex
+		for (int i = 1; i + 1 < count; ++i) {
+			auto& triangle = triangles[triangle_offsets[primitive_id] + i - 1];
+			for (size_t j = 0; j < 3; ++j) {
+				triangle.vertex_ids[j] = unsigned(shaded_base + index_buffer->item(vertex_id + j));
+			}
+			triangle.primitive_id = primitive_id;
+			if (!setup_triangle(triangle, polygon[0], polygon[i], polygon[i + 1], primitive_statistics)) {
+				triangle.edge = 0.f;
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::setup_triangle(
+			raster_triangle& triangle, const clip_vertex& a, const clip_vertex& b, const clip_vertex& c,
+			raster_statistics& triangle_statistics)
+	{
+		const clip_vertex* vertices[3] = {&a, &b, &c};
+		int2 screen[3];
+		for (size_t i = 0; i < 3; ++i) {
+			const float4& clip = vertices[i]->position;
+			float3 position = float3{clip.x, clip.y, clip.z} / clip.w;
+			triangle.inv_w[i] = 1.f / clip.w;
+			triangle.z[i] = position.z;
+			// The guard band keeps snapped coordinates well inside the 32-bit range
+			screen[i].x = int(std::lround((position.x + 1) * width / 2.f * subpixel_scale));
+			screen[i].y = int(std::lround((-position.y + 1) * height / 2.f * subpixel_scale));
+		}
+		triangle.vertex_bary = float3x3{a.bary, b.bary, c.bary};
+
+		triangle.a = screen[0];
+		triangle.b = screen[1];
+		triangle.c = screen[2];
+
+		int64_t area = edge_function(triangle.a, triangle.b, triangle.c);
+		if (area == 0) {
+			++triangle_statistics.zero_area_culled;
+			return false;
+		}
+
+		bool front_facing = area > 0;
+		if ((cull == cull_mode::back && !front_facing) || (cull == cull_mode::front && front_facing)) {
+			++triangle_statistics.face_culled;
+			return false;
+		}
+
+		// Coverage tests expect a positive area, so kept back faces swap their last two vertices
+		if (!front_facing) {
+			std::swap(triangle.b, triangle.c);
+			std::swap(triangle.z[1], triangle.z[2]);
+			std::swap(triangle.inv_w[1], triangle.inv_w[2]);
+			std::swap(triangle.vertex_bary[1], triangle.vertex_bary[2]);
+			area = -area;
+		}
+		triangle.edge = float(area);
+
+		// Edge 0 is a->b, edge 1 is b->c, edge 2 is c->a, matching `edge_function`
+		const int2 from[3] = {triangle.a, triangle.b, triangle.c};
+		const int2 to[3] = {triangle.b, triangle.c, triangle.a};
+		for (int i = 0; i < 3; ++i) {
+			triangle.step_x[i] = to[i].y - from[i].y;
+			triangle.step_y[i] = from[i].x - to[i].x;
+			triangle.offset[i] = -int64_t(from[i].x) * triangle.step_x[i] - int64_t(from[i].y) * triangle.step_y[i];
+		}
+
+		// Depth is linear in screen space: z = u * z0 + v * z1 + w * z2 with u = edge1 / area and so on
+		float3 step_x = float3(triangle.step_x) * float(subpixel_scale) / triangle.edge;
+		float3 step_y = float3(triangle.step_y) * float(subpixel_scale) / triangle.edge;
+		triangle.depth_gradient = float2{
+				step_x[1] * triangle.z[0] + step_x[2] * triangle.z[1] + step_x[0] * triangle.z[2],
+				step_y[1] * triangle.z[0] + step_y[2] * triangle.z[1] + step_y[0] * triangle.z[2]};
+		// Interpolated depth can round past the vertex depths, so the range keeps a margin and
+		// fragments at the same depth as the stored one are never rejected early
+		triangle.depth_margin = 1e-5f * std::max(std::abs(minelem(triangle.z)), std::abs(maxelem(triangle.z)));
+		triangle.min_z = minelem(triangle.z) - triangle.depth_margin;
+		triangle.max_z = maxelem(triangle.z) + triangle.depth_margin;
+
+		// Pixels whose samples can fall inside the fixed point bounding box
+		int2 min_vertex = min(triangle.a, min(triangle.b, triangle.c)) - sample_extent;
+		int2 max_vertex = max(triangle.a, max(triangle.b, triangle.c)) + sample_extent;
+		int2 min_pixel{
+				-((-min_vertex.x) >> subpixel_bits),
+				-((-min_vertex.y) >> subpixel_bits)};
+		int2 max_pixel{max_vertex.x >> subpixel_bits, max_vertex.y >> subpixel_bits};
+
+		int2 min_viewport = int2{0, 0};
+		int2 max_viewport = int2{(int) width - 1, (int) height - 1};
+
+		if (max_pixel.x < std::max(min_pixel.x, min_viewport.x) || max_pixel.y < std::max(min_pixel.y, min_viewport.y) ||
+			min_pixel.x > max_viewport.x || min_pixel.y > max_viewport.y) {
+			++triangle_statistics.no_samples_culled;
+			return false;
+		}
+
+		triangle.begin = clamp(min_pixel, min_viewport, max_viewport);
+		triangle.end = clamp(max_pixel, min_viewport, max_viewport);
+
+		if (!covers_samples(triangle)) {
+			++triangle_statistics.no_samples_culled;
+			return false;
+		}
+
+		++triangle_statistics.rasterized;
+		return true;
+	}
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::covers_samples(const raster_triangle& triangle) const
+	{
+		int2 size = triangle.end - triangle.begin + 1;
+		if (size.x * size.y > small_triangle_pixels) {
+			return true;
+		}
+
+		for (int y = triangle.begin.y; y <= triangle.end.y; ++y) {
+			for (int x = triangle.begin.x; x <= triangle.end.x; ++x) {
+				for (unsigned int sample = 0; sample < samples; ++sample) {
+					int64_t sample_x = int64_t(x) * subpixel_scale + sample_offsets[sample].x;
+					int64_t sample_y = int64_t(y) * subpixel_scale + sample_offsets[sample].y;
+					bool inside = true;
+					for (int i = 0; i < 3; ++i) {
+						inside = inside && triangle.step_x[i] * sample_x + triangle.step_y[i] * sample_y + triangle.offset[i] >= 0;
+					}
+					if (inside) {
+						return true;
+					}
+				}
+			}
+		}
+		return false;
+	}
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::update_tile_grid()
+	{
+		tiles_x = (width + tile_size - 1) / tile_size;
+		tiles_y = (height + tile_size - 1) / tile_size;
+		blocks_x = (width + block_size - 1) / block_size;
+		blocks_y = (height + block_size - 1) / block_size;
+		tile_bins.resize(tiles_x * tiles_y);
+		// Memory of a new target or viewport holds its contents, not a pending clear
+		if (tile_cleared.size() != tiles_x * tiles_y) {
+			tile_cleared.assign(tiles_x * tiles_y, 0);
+		}
+
+		// Likewise new sample storage starts from the resolved targets
+		if (samples > 1) {
+			const size_t num_samples = width * height * samples;
+			if (render_target && sample_colors.size() != num_samples) {
+				sample_colors.resize(num_samples);
+				for (size_t y = 0; y < height; ++y) {
+					for (size_t x = 0; x < width; ++x) {
+						std::fill_n(sample_colors.begin() + (y * width + x) * samples, samples, render_target->item(x, y));
+					}
+				}
+			}
+			if (depth_buffer && sample_depths.size() != num_samples) {
+				sample_depths.resize(num_samples);
+				for (size_t y = 0; y < height; ++y) {
+					for (size_t x = 0; x < width; ++x) {
+						std::fill_n(sample_depths.begin() + (y * width + x) * samples, samples, depth_buffer->item(x, y));
+					}
+				}
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::fill_tile(size_t tile_id, bool resolved)
+	{
+		// With multisampling the clear values go to the samples before drawing and to the
+		// resolved targets on resolve, the samples of untouched tiles are never written
+		const bool sample_storage = samples > 1 && !resolved;
+		const int tile_x = int(tile_id % tiles_x) * tile_size;
+		const int tile_y = int(tile_id / tiles_x) * tile_size;
+		const size_t count = size_t(std::min(tile_x + tile_size, int(width)) - tile_x);
+		const int tile_end_y = std::min(tile_y + tile_size, int(height));
+
+		for (int y = tile_y; y < tile_end_y; ++y) {
+			const size_t first = size_t(y) * width + tile_x;
+			if (sample_storage) {
+				if (render_target) {
+					std::fill_n(sample_colors.begin() + first * samples, count * samples, clear_value);
+				}
+				if (depth_buffer) {
+					std::fill_n(sample_depths.begin() + first * samples, count * samples, clear_depth);
+				}
+			}
+			else {
+				if (render_target) {
+					std::fill_n(&render_target->item(tile_x, y), count, clear_value);
+				}
+				if (depth_buffer) {
+					std::fill_n(&depth_buffer->item(tile_x, y), count, clear_depth);
+				}
+			}
+			if (visibility_buffer) {
+				std::fill_n(&visibility_buffer->item(tile_x, y), count, cg::visibility{});
+			}
+			for (const auto& output: output_targets) {
+				if (output.target) {
+					output.clear(output.target.get(), size_t(tile_x), size_t(y), count);
+				}
+			}
+		}
+
+		if (samples == 1 || !resolved) {
+			tile_cleared[tile_id] = 0;
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::bin_triangles()
 	{
-		return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
+		update_tile_grid();
+		for (auto& bin: tile_bins) {
+			bin.clear();
+		}
+
+		// Bins are filled in submission order, so every pixel sees triangles in the serial order
+		for (unsigned int triangle_id = 0; triangle_id < triangles.size(); ++triangle_id) {
+			const auto& triangle = triangles[triangle_id];
+			if (triangle.edge == 0.f) {
+				continue;
+			}
+
+			int first_tile_x = triangle.begin.x / tile_size;
+			int last_tile_x = triangle.end.x / tile_size;
+			int first_tile_y = triangle.begin.y / tile_size;
+			int last_tile_y = triangle.end.y / tile_size;
+
+			for (int tile_y = first_tile_y; tile_y <= last_tile_y; ++tile_y) {
+				for (int tile_x = first_tile_x; tile_x <= last_tile_x; ++tile_x) {
+					tile_bins[tile_y * tiles_x + tile_x].push_back(triangle_id);
+				}
+			}
+		}
 	}
 
 	template<typename VB, typename RT>
-	inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+	inline void rasterizer<VB, RT>::rasterize_tile(size_t tile_id, raster_statistics& tile_statistics)
+	{
+		const int tile_x = int(tile_id % tiles_x) * tile_size;
+		const int tile_y = int(tile_id / tiles_x) * tile_size;
+		const int tile_end_x = std::min(tile_x + tile_size, int(width)) - 1;
+		const int tile_end_y = std::min(tile_y + tile_size, int(height)) - 1;
+		const bool depth_kernel = samples == 1 && is_depth_only();
+
+		for (unsigned int triangle_id: tile_bins[tile_id]) {
+			const auto& triangle = triangles[triangle_id];
+
+			// A pixel passes the depth test only if it is nearer than the stored depth
+			if (depth_buffer && triangle.min_z >= tile_max_depth[tile_id]) {
+				continue;
+			}
+
+			int2 begin = max(triangle.begin, int2{tile_x, tile_y});
+			int2 end = min(triangle.end, int2{tile_end_x, tile_end_y});
+			bool tile_written = false;
+
+			// Tiles are aligned to blocks, so blocks never cross a tile border
+			for (int block_y = begin.y - begin.y % block_size; block_y <= end.y; block_y += block_size) {
+				for (int block_x = begin.x - begin.x % block_size; block_x <= end.x; block_x += block_size) {
+					int2 pixel_begin = max(begin, int2{block_x, block_y});
+					int2 pixel_end = min(end, int2{block_x + block_size - 1, block_y + block_size - 1});
+
+					bool test_depth = bool(depth_buffer);
+					size_t block_id = (block_y / block_size) * blocks_x + block_x / block_size;
+					if (depth_buffer) {
+						float2 bounds = get_depth_bounds(triangle, pixel_begin, pixel_end);
+						if (bounds.x >= block_max_depth[block_id]) {
+							continue;
+						}
+						test_depth = bounds.y >= block_min_depth[block_id];
+					}
+
+					raster_block block;
+					if (setup_block(triangle, block_x, block_y, block) == block_coverage::outside) {
+						continue;
+					}
+					if (tile_cleared[tile_id]) {
+						fill_tile(tile_id, false);
+					}
+
+					// Every sample has its own span, offset from the pixel centres by the sample position
+					const unsigned int all_samples = (1u << samples) - 1;
+					const float3 pixel_step = float3(triangle.step_x) * float(subpixel_scale);
+					const float inv_area = 1.f / triangle.edge;
+					bool block_written = false;
+					for (int y = pixel_begin.y; y <= pixel_end.y; ++y) {
+						edge_span spans[max_samples];
+						if (block.coverage == block_coverage::partial) {
+							for (unsigned int sample = 0; sample < samples; ++sample) {
+								int3 offset = block.offset + block.step_x * sample_offsets[sample].x + block.step_y * sample_offsets[sample].y;
+								spans[sample] = edge_span(
+										block.step_x * subpixel_scale, block.step_y * subpixel_scale, offset,
+										pixel_begin.x - block_x, y - block_y);
+							}
+						}
+						const float3 row_edge = block.edge + float3(triangle.step_y) * float(subpixel_scale * (y - block_y));
+
+						for (int x = pixel_begin.x; x <= pixel_end.x; x += edge_span::width) {
+							int lanes = std::min(edge_span::width, pixel_end.x - x + 1);
+							unsigned int coverage[edge_span::width];
+							for (int lane = 0; lane < edge_span::width; ++lane) {
+								coverage[lane] = lane < lanes ? all_samples : 0;
+							}
+							if (block.coverage == block_coverage::partial) {
+								for (unsigned int sample = 0; sample < samples; ++sample) {
+									int mask = spans[sample].coverage();
+									for (int lane = 0; lane < edge_span::width; ++lane) {
+										coverage[lane] &= ~(unsigned(!(mask & (1 << lane))) << sample);
+									}
+									spans[sample].advance();
+								}
+							}
+
+							if (!(coverage[0] | coverage[1] | coverage[2] | coverage[3])) {
+								continue;
+							}
+
+							if (depth_kernel) {
+								int mask = 0;
+								for (int lane = 0; lane < lanes; ++lane) {
+									mask |= int(coverage[lane] != 0) << lane;
+								}
+								int passed = write_depth_span(
+										triangle, x, y, float(x - block_x), row_edge, pixel_step, inv_area, mask, lanes, test_depth);
+								for (int lane = 0; lane < lanes; ++lane) {
+									tile_statistics.fragments += (mask >> lane) & 1;
+									tile_statistics.depth_passed += (passed >> lane) & 1;
+								}
+								block_written |= passed != 0;
+								continue;
+							}
+
+							// Shading happens once per pixel, at its centre
+							float u[edge_span::width], v[edge_span::width], w[edge_span::width];
+							for (int lane = 0; lane < edge_span::width; ++lane) {
+								const float dx = float(x + lane - block_x);
+								u[lane] = (row_edge[1] + pixel_step[1] * dx) * inv_area;
+								v[lane] = (row_edge[2] + pixel_step[2] * dx) * inv_area;
+								w[lane] = (row_edge[0] + pixel_step[0] * dx) * inv_area;
+							}
+							for (int lane = 0; lane < lanes; ++lane) {
+								if (coverage[lane]) {
+									++tile_statistics.fragments;
+									if (shade_pixel(triangle, x + lane, y, u[lane], v[lane], w[lane], coverage[lane], test_depth)) {
+										++tile_statistics.depth_passed;
+										block_written = true;
+									}
+								}
+							}
+						}
+					}
+
+					if (depth_buffer && block_written) {
+						update_block_depth(block_x / block_size, block_y / block_size);
+						tile_written = true;
+					}
+				}
+			}
+
+			if (tile_written) {
+				update_tile_depth(tile_id);
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline float2 rasterizer<VB, RT>::get_depth_bounds(
+			const raster_triangle& triangle, int2 begin, int2 end) const
+	{
+		// The depth plane reaches its extremes over a rectangle at the corners, the margin covers
+		// rounding of per-pixel interpolation. Both bounds are also limited by the widened vertex depths.
+		const float extent = float(sample_extent) / float(subpixel_scale);
+		const float2 origin = float2(triangle.a) / float(subpixel_scale);
+		float2 from = (float2(begin) - extent - origin) * triangle.depth_gradient;
+		float2 to = (float2(end) + extent - origin) * triangle.depth_gradient;
+		float plane_min = triangle.z[0] + std::min(from.x, to.x) + std::min(from.y, to.y);
+		float plane_max = triangle.z[0] + std::max(from.x, to.x) + std::max(from.y, to.y);
+		return float2{
+				std::max(plane_min - triangle.depth_margin, triangle.min_z),
+				std::min(plane_max + triangle.depth_margin, triangle.max_z)};
+	}
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::build_depth_pyramid()
+	{
+		block_min_depth.resize(blocks_x * blocks_y);
+		block_max_depth.resize(blocks_x * blocks_y);
+		tile_max_depth.resize(tiles_x * tiles_y);
+
+		const int num_tiles = int(tile_max_depth.size());
+#pragma omp parallel for
+		for (int tile_id = 0; tile_id < num_tiles; ++tile_id) {
+			const int first_block_x = int(tile_id % tiles_x) * (tile_size / block_size);
+			const int first_block_y = int(tile_id / tiles_x) * (tile_size / block_size);
+			const int last_block_x = std::min(first_block_x + tile_size / block_size, int(blocks_x));
+			const int last_block_y = std::min(first_block_y + tile_size / block_size, int(blocks_y));
+			for (int block_y = first_block_y; block_y < last_block_y; ++block_y) {
+				for (int block_x = first_block_x; block_x < last_block_x; ++block_x) {
+					if (tile_cleared[tile_id]) {
+						block_min_depth[block_y * blocks_x + block_x] = clear_depth;
+						block_max_depth[block_y * blocks_x + block_x] = clear_depth;
+					}
+					else {
+						update_block_depth(block_x, block_y);
+					}
+				}
+			}
+			update_tile_depth(size_t(tile_id));
+		}
+		depth_pyramid_valid = true;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::update_block_depth(int block_x, int block_y)
+	{
+		const int x_begin = block_x * block_size;
+		const int y_begin = block_y * block_size;
+		const int x_end = std::min(x_begin + block_size, int(width));
+		const int y_end = std::min(y_begin + block_size, int(height));
+
+		float min_depth = std::numeric_limits<float>::max();
+		float max_depth = std::numeric_limits<float>::lowest();
+		for (int y = y_begin; y < y_end; ++y) {
+			for (int x = x_begin; x < x_end; ++x) {
+				for (unsigned int sample = 0; sample < samples; ++sample) {
+					float depth = get_sample_depth(x, y, sample);
+					min_depth = std::min(min_depth, depth);
+					max_depth = std::max(max_depth, depth);
+				}
+			}
+		}
+
+		size_t block_id = block_y * blocks_x + block_x;
+		block_min_depth[block_id] = min_depth;
+		block_max_depth[block_id] = max_depth;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::update_tile_depth(size_t tile_id)
+	{
+		const int first_block_x = int(tile_id % tiles_x) * (tile_size / block_size);
+		const int first_block_y = int(tile_id / tiles_x) * (tile_size / block_size);
+		const int last_block_x = std::min(first_block_x + tile_size / block_size, int(blocks_x));
+		const int last_block_y = std::min(first_block_y + tile_size / block_size, int(blocks_y));
+
+		float max_depth = std::numeric_limits<float>::lowest();
+		for (int block_y = first_block_y; block_y < last_block_y; ++block_y) {
+			for (int block_x = first_block_x; block_x < last_block_x; ++block_x) {
+				max_depth = std::max(max_depth, block_max_depth[block_y * blocks_x + block_x]);
+			}
+		}
+		tile_max_depth[tile_id] = max_depth;
+	}
+
+	template<typename VB, typename RT>
+	inline block_coverage rasterizer<VB, RT>::setup_block(
+			const raster_triangle& triangle, int x, int y, raster_block& block) const
+	{
+		// Edge functions are linear, so their extremes over the block's samples lie at its corners
+		const int64_t low = -sample_extent;
+		const int64_t high = (block_size - 1) * subpixel_scale + sample_extent;
+		const int64_t origin_x = int64_t(x) * subpixel_scale;
+		const int64_t origin_y = int64_t(y) * subpixel_scale;
+
+		bool inside = true;
+		for (int i = 0; i < 3; ++i) {
+			const int64_t step_x = triangle.step_x[i];
+			const int64_t step_y = triangle.step_y[i];
+			int64_t value = step_x * origin_x + step_y * origin_y + triangle.offset[i];
+			int64_t min_value = value + std::min(step_x * low, step_x * high) + std::min(step_y * low, step_y * high);
+			int64_t max_value = value + std::max(step_x * low, step_x * high) + std::max(step_y * low, step_y * high);
+
+			if (max_value < 0) {
+				block.coverage = block_coverage::outside;
+				return block.coverage;
+			}
+
+			block.edge[i] = float(value);
+			if (min_value >= 0) {
+				block.step_x[i] = 0;
+				block.step_y[i] = 0;
+				block.offset[i] = 0;
+			}
+			else {
+				inside = false;
+				block.step_x[i] = triangle.step_x[i];
+				block.step_y[i] = triangle.step_y[i];
+				block.offset[i] = int(value);
+			}
+		}
+		block.coverage = inside ? block_coverage::inside : block_coverage::partial;
+		return block.coverage;
+	}
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::shade_pixel(
+			const raster_triangle& triangle, int x, int y, float u, float v, float w,
+			unsigned int coverage, bool test_depth)
+	{
+		float depth = u * triangle.z[0] + v * triangle.z[1] + w * triangle.z[2];
+
+		float sample_depth[max_samples];
+		unsigned int passed = 0;
+		if (samples == 1) {
+			sample_depth[0] = depth;
+			passed = !test_depth || depth_test(depth, x, y, 0);
+		}
+		else {
+			for (unsigned int sample = 0; sample < samples; ++sample) {
+				if (coverage & (1u << sample)) {
+					float2 offset = float2(sample_offsets[sample]) / float(subpixel_scale);
+					sample_depth[sample] = depth + dot(triangle.depth_gradient, offset);
+					if (!test_depth || depth_test(sample_depth[sample], x, y, sample)) {
+						passed |= 1u << sample;
+					}
+				}
+			}
+		}
+		if (!passed) {
+			return false;
+		}
+
+		if ((render_target || mrt_pixel_shader) && !visibility_shading) {
+			cg::color pixel_result;
+			if (mrt_pixel_shader) {
+				auto outputs = shade_interpolated(mrt_pixel_shader, triangle, float3{u, v, w}, depth);
+				write_output_targets(size_t(x), size_t(y), outputs);
+				pixel_result = outputs.color;
+			}
+			else if (interpolated_pixel_shader) {
+				pixel_result = shade_interpolated(interpolated_pixel_shader, triangle, float3{u, v, w}, depth);
+			}
+			else {
+				pixel_result = pixel_shader(get_shaded_vertex(triangle.vertex_ids[0]), depth);
+			}
+
+			if (render_target) {
+				RT color = RT::from_color(pixel_result);
+				if (samples == 1) {
+					render_target->item(x, y) = color;
+				}
+				else {
+					RT* colors = &sample_colors[(size_t(y) * width + x) * samples];
+					for (unsigned int sample = 0; sample < samples; ++sample) {
+						if (passed & (1u << sample)) {
+							colors[sample] = color;
+						}
+					}
+				}
+			}
+		}
+		if (depth_buffer) {
+			for (unsigned int sample = 0; sample < samples; ++sample) {
+				if (passed & (1u << sample)) {
+					get_sample_depth(x, y, sample) = sample_depth[sample];
+				}
+			}
+		}
+		if (visibility_buffer) {
+			auto& sample = visibility_buffer->item(x, y);
+			sample.draw_id = draw_id;
+			sample.primitive_id = triangle.primitive_id;
+			// In the visibility-buffer mode barycentrics are left to the shading pass
+			if (!visibility_shading) {
+				float3 bary = float3{u, v, w} * triangle.inv_w;
+				sample.bary = mul(triangle.vertex_bary, bary / (bary.x + bary.y + bary.z));
+			}
+		}
+		return true;
+	}
+
+	template<typename VB, typename RT>
+	template<typename S>
+	inline auto rasterizer<VB, RT>::shade_interpolated(
+			const S& shader, const raster_triangle& triangle, const float3& weights, float depth)
+	{
+		// Screen-space weights step linearly, the next pixels are projected like the current one
+		const float scale = float(subpixel_scale) / triangle.edge;
+		const float3 step_x = float3{float(triangle.step_x[1]), float(triangle.step_x[2]), float(triangle.step_x[0])} * scale;
+		const float3 step_y = float3{float(triangle.step_y[1]), float(triangle.step_y[2]), float(triangle.step_y[0])} * scale;
+		auto get_bary = [&](const float3& screen_weights) {
+			float3 bary = screen_weights * triangle.inv_w;
+			return mul(triangle.vertex_bary, bary / (bary.x + bary.y + bary.z));
+		};
+
+		const VB& a = get_shaded_vertex(triangle.vertex_ids[0]);
+		const VB& b = get_shaded_vertex(triangle.vertex_ids[1]);
+		const VB& c = get_shaded_vertex(triangle.vertex_ids[2]);
+		const float3 bary = get_bary(weights);
+		return shader(
+				interpolate(a, b, c, bary),
+				interpolate(a, b, c, get_bary(weights + step_x) - bary),
+				interpolate(a, b, c, get_bary(weights + step_y) - bary),
+				depth);
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::write_output_targets(size_t x, size_t y, const pixel_outputs& outputs)
+	{
+		for (size_t slot = 0; slot < max_output_targets; ++slot) {
+			const output_target& output = output_targets[slot];
+			if (output.target) {
+				output.write(output.target.get(), x, y, outputs.targets[slot]);
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	template<typename T>
+	inline void rasterizer<VB, RT>::write_output(void* target, size_t x, size_t y, const float4& value)
+	{
+		T& item = static_cast<resource<T>*>(target)->item(x, y);
+		if constexpr (std::is_same_v<T, float>) {
+			item = value.x;
+		}
+		else if constexpr (std::is_same_v<T, float2>) {
+			item = float2{value.x, value.y};
+		}
+		else if constexpr (std::is_same_v<T, float3>) {
+			item = float3{value.x, value.y, value.z};
+		}
+		else if constexpr (std::is_same_v<T, float4>) {
+			item = value;
+		}
+		else {
+			static_assert(std::is_same_v<T, cg::color> || std::is_same_v<T, cg::unsigned_color>, "Unsupported output target format");
+			item = T::from_float3(float3{value.x, value.y, value.z});
+		}
+	}
+
+	template<typename VB, typename RT>
+	template<typename T>
+	inline void rasterizer<VB, RT>::clear_output(void* target, size_t x, size_t y, size_t count)
+	{
+		std::fill_n(&static_cast<resource<T>*>(target)->item(x, y), count, T{});
+	}
+
+	template<typename VB, typename RT>
+	inline float& rasterizer<VB, RT>::get_sample_depth(int x, int y, unsigned int sample)
+	{
+		if (samples == 1) {
+			return depth_buffer->item(x, y);
+		}
+		return sample_depths[(size_t(y) * width + x) * samples + sample];
+	}
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::is_depth_only() const
+	{
+		return depth_buffer && !render_target && !mrt_pixel_shader && !visibility_buffer;
+	}
+
+	template<typename VB, typename RT>
+	inline int rasterizer<VB, RT>::write_depth_span(
+			const raster_triangle& triangle, int x, int y, float dx, const float3& row_edge,
+			const float3& pixel_step, float inv_area, int mask, int lanes, bool test_depth)
+	{
+		// Depth is computed in the same order as in `shade_pixel`, so both paths write equal values
+		float* depths = &depth_buffer->item(x, y);
+#ifdef CG_RASTERIZER_SSE2
+		// A full span stays inside the row, so its four depths are loaded and stored at once
+		if (lanes == edge_span::width) {
+			const __m128 lane_dx = _mm_add_ps(_mm_set1_ps(dx), _mm_setr_ps(0.f, 1.f, 2.f, 3.f));
+			const __m128 scale = _mm_set1_ps(inv_area);
+			auto weight = [&](int edge) {
+				return _mm_mul_ps(_mm_add_ps(_mm_set1_ps(row_edge[edge]), _mm_mul_ps(_mm_set1_ps(pixel_step[edge]), lane_dx)), scale);
+			};
+			__m128 depth = _mm_add_ps(
+					_mm_add_ps(_mm_mul_ps(weight(1), _mm_set1_ps(triangle.z[0])), _mm_mul_ps(weight(2), _mm_set1_ps(triangle.z[1]))),
+					_mm_mul_ps(weight(0), _mm_set1_ps(triangle.z[2])));
+
+			__m128i lane_bits = _mm_and_si128(_mm_set1_epi32(mask), _mm_setr_epi32(1, 2, 4, 8));
+			__m128 pass = _mm_castsi128_ps(_mm_cmpgt_epi32(lane_bits, _mm_setzero_si128()));
+			__m128 stored = _mm_loadu_ps(depths);
+			if (test_depth) {
+				pass = _mm_and_ps(pass, _mm_cmplt_ps(depth, stored));
+			}
+			_mm_storeu_ps(depths, _mm_or_ps(_mm_and_ps(pass, depth), _mm_andnot_ps(pass, stored)));
+			return _mm_movemask_ps(pass);
+		}
+#endif
+		int passed = 0;
+		for (int lane = 0; lane < lanes; ++lane) {
+			if (!(mask & (1 << lane))) {
+				continue;
+			}
+			const float lane_dx = dx + float(lane);
+			float u = (row_edge[1] + pixel_step[1] * lane_dx) * inv_area;
+			float v = (row_edge[2] + pixel_step[2] * lane_dx) * inv_area;
+			float w = (row_edge[0] + pixel_step[0] * lane_dx) * inv_area;
+			float depth = u * triangle.z[0] + v * triangle.z[1] + w * triangle.z[2];
+			if (!test_depth || depths[lane] > depth) {
+				depths[lane] = depth;
+				passed |= 1 << lane;
+			}
+		}
+		return passed;
+	}
+
+	template<typename VB, typename RT>
+	inline int64_t
+	rasterizer<VB, RT>::edge_function(int2 a, int2 b, int2 c)
+	{
+		return int64_t(c.x - a.x) * (b.y - a.y) - int64_t(c.y - a.y) * (b.x - a.x);
+	}
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y, unsigned int sample)
 	{
 		if (!depth_buffer)
 		{
 			return true;
 		}
-		return depth_buffer->item(x, y) > z;
+		return get_sample_depth(int(x), int(y), sample) > z;
+	}
+
+#ifdef CG_RASTERIZER_SSE2
+	inline edge_span::edge_span(const int3& step_x, const int3& step_y, const int3& offset, int x, int y)
+	{
+		for (int i = 0; i < 3; ++i) {
+			__m128i lane_offsets = _mm_setr_epi32(0, step_x[i], 2 * step_x[i], 3 * step_x[i]);
+			value[i] = _mm_add_epi32(_mm_set1_epi32(step_x[i] * x + step_y[i] * y + offset[i]), lane_offsets);
+			step[i] = _mm_set1_epi32(width * step_x[i]);
+		}
+	}
+
+	inline void edge_span::advance()
+	{
+		for (int i = 0; i < 3; ++i) {
+			value[i] = _mm_add_epi32(value[i], step[i]);
+		}
+	}
+
+	inline int edge_span::coverage() const
+	{
+		// A pixel is outside if any edge value has its sign bit set
+		__m128i outside = _mm_or_si128(_mm_or_si128(value[0], value[1]), value[2]);
+		return ~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xF;
+	}
+
+#else
+	inline edge_span::edge_span(const int3& step_x, const int3& step_y, const int3& offset, int x, int y)
+	{
+		for (int i = 0; i < 3; ++i) {
+			int start = step_x[i] * x + step_y[i] * y + offset[i];
+			for (int lane = 0; lane < width; ++lane) {
+				value[i][lane] = start + lane * step_x[i];
+			}
+			step[i] = width * step_x[i];
+		}
 	}
 
+	inline void edge_span::advance()
+	{
+		for (int i = 0; i < 3; ++i) {
+			for (int lane = 0; lane < width; ++lane) {
+				value[i][lane] += step[i];
+			}
+		}
+	}
+
+	inline int edge_span::coverage() const
+	{
+		int mask = 0;
+		for (int lane = 0; lane < width; ++lane) {
+			bool inside = 0 <= value[0][lane] && 0 <= value[1][lane] && 0 <= value[2][lane];
+			mask |= int(inside) << lane;
+		}
+		return mask;
+	}
+
+#endif
+
 }// namespace cg::renderer
\ No newline at end of file
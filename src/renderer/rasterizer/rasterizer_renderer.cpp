@@ -1,24 +1,29 @@
 #ifdef _WIN32
 #define _USE_MATH_DEFINES
 #endif
+#include <algorithm>
 #include <cmath>
-#include <gif.h>
+#include <numeric>
+#include <omp.h>
 
 #include "rasterizer_renderer.h"
+#include "utils/gif_writer.h"
 #include "utils/resource_utils.h"
+#include "world/frustum.h"
 
 
 void cg::renderer::rasterization_renderer::init()
 {
-	render_target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
-	depth_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height);
-	rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
-
-	rasterizer->set_viewport(settings->width, settings->height);
-	rasterizer->set_render_target(render_target, depth_buffer);
+	for (unsigned i = 0; i < std::max(settings->parallel_frames, 1u); ++i) {
+		contexts.push_back(create_context());
+	}
 
 	model = std::make_shared<cg::world::model>();
 	model->load_obj(settings->model_path);
+	model->load_textures();
+	if (settings->lod_pixel_error > 0.f) {
+		model->build_lods();
+	}
 
 	for (size_t i = 0; i < model->get_index_buffers().size(); ++i) {
 		auto vertex_buffer_size = model->get_vertex_buffers()[i]->size_bytes();
@@ -56,56 +61,199 @@ void cg::renderer::rasterization_renderer::render()
 			model->get_world_matrix()
 	);
 
-	rasterizer->vertex_shader = [&](float4 vertex, cg::vertex vertex_data) {
-		float4 transformed = mul(matrix, vertex);
-		return std::make_pair(transformed, vertex_data);
-	};
-
-	rasterizer->pixel_shader = [](cg::vertex vertex_data, float z) {
-		return cg::color::from_float3(vertex_data.ambient);
+	const auto& textures = model->get_textures();
+	auto get_albedo = [&textures](const cg::vertex& vertex_data, const cg::vertex& ddx, const cg::vertex& ddy) {
+		if (vertex_data.texture_id < textures.size()) {
+			const auto& texture = *textures[vertex_data.texture_id];
+			float lod = texture.get_lod(ddx.texture, ddy.texture);
+			return vertex_data.diffuse * texture.sample(vertex_data.texture, lod);
+		}
+		return vertex_data.diffuse;
 	};
+	for (auto& context: contexts) {
+		auto& rasterizer = context.rasterizer;
+		rasterizer->pixel_shader = [](cg::vertex vertex_data, float z) {
+			return cg::color::from_float3(vertex_data.ambient);
+		};
+		if (settings->save_aovs) {
+			rasterizer->mrt_pixel_shader = [&textures, get_albedo](const cg::vertex& vertex_data, const cg::vertex& ddx, const cg::vertex& ddy, float z) {
+				cg::renderer::pixel_outputs outputs;
+				float3 albedo = get_albedo(vertex_data, ddx, ddy);
+				float3 result = vertex_data.ambient;
+				if (vertex_data.texture_id < textures.size()) {
+					result += albedo;
+				}
+				outputs.color = cg::color::from_float3(result);
+				float normal_length = length(vertex_data.normal);
+				outputs.targets[0] = float4{normal_length > 0.f ? vertex_data.normal / normal_length : vertex_data.normal, 0.f};
+				outputs.targets[1] = float4{albedo, 0.f};
+				return outputs;
+			};
+		}
+		else if (!textures.empty()) {
+			rasterizer->interpolated_pixel_shader = [&textures, get_albedo](const cg::vertex& vertex_data, const cg::vertex& ddx, const cg::vertex& ddy, float z) {
+				float3 result = vertex_data.ambient;
+				if (vertex_data.texture_id < textures.size()) {
+					result += get_albedo(vertex_data, ddx, ddy);
+				}
+				return cg::color::from_float3(result);
+			};
+		}
+	}
 
-	GifWriter gif;
-	size_t width = render_target->get_stride();
-	size_t height = render_target->count() / width;
-	GifBegin(&gif, "result.gif", width, height, 10);
+	size_t width = settings->width;
+	size_t height = settings->height;
+	// Frame N is converted and encoded while frame N + 1 is rasterized
+	cg::utils::gif_writer gif("result.gif", width, height, 10);
 
 	size_t frames = 50;
-	for (size_t i = 0; i < frames; ++i) {
-		auto start = std::chrono::high_resolution_clock ::now();
-		rasterizer->clear_render_target({0, 0, 0});
-		auto end = std::chrono::high_resolution_clock ::now();
-		auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-		std::cout << "Clearing: " << double(time.count()) / 1000.0 << " ms" << std::endl;
-
-		for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); ++shape_id) {
-			rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
-			rasterizer->set_index_buffer(model->get_index_buffers()[shape_id]);
-			rasterizer->draw(model->get_index_buffers()[shape_id]->count(), 0);
+	float angle = 2 * (float) M_PI / (float) frames;
+	size_t last_context = 0;
+	// Frames of a batch run the rasterizer on a single thread each, a single batched frame keeps all threads
+	const int max_active_levels = omp_get_max_active_levels();
+	omp_set_max_active_levels(1);
+	for (size_t first_frame = 0; first_frame < frames; first_frame += contexts.size()) {
+		size_t batch = std::min(contexts.size(), frames - first_frame);
+		std::vector<double> clearing_times(batch);
+
+		// Frames of a batch are independent
+#pragma omp parallel for num_threads(int(batch)) schedule(static, 1) if (batch > 1)
+		for (int i = 0; i < int(batch); ++i) {
+			float4x4 frame_matrix = linalg::mul(
+					matrix,
+					linalg::rotation_matrix(linalg::rotation_quat(float3{0, 1, 0}, angle * float(first_frame + i)))
+			);
+			clearing_times[i] = render_frame(contexts[i], frame_matrix);
 		}
 
-		float angle = 2 * (float) M_PI / (float) frames;
-		matrix = linalg::mul(
-				matrix,
-				linalg::rotation_matrix(linalg::rotation_quat(float3{0, 1, 0}, angle))
-		);
-
-		std::vector<uint8_t> rgba;
-		rgba.reserve(width * height * 4);
-
-		for (size_t j = 0; j < width * height; ++j) {
-			const auto& color = render_target->get_data()[j];
-			rgba.emplace_back(color.r);
-			rgba.emplace_back(color.g);
-			rgba.emplace_back(color.b);
-			rgba.emplace_back(255);
+		// Frames go to the encoder in order regardless of which worker finished first
+		for (size_t i = 0; i < batch; ++i) {
+			std::cout << "Clearing: " << clearing_times[i] << " ms" << std::endl;
+			gif.write_frame(*contexts[i].render_target);
 		}
+		last_context = batch - 1;
+	}
+	omp_set_max_active_levels(max_active_levels);
+
+	gif.finish();
+
+	cg::renderer::raster_statistics statistics;
+	for (const auto& context: contexts) {
+		statistics += context.rasterizer->get_statistics();
+	}
+	std::cout << "Primitives: " << statistics.primitives
+			  << ", rasterized triangles: " << statistics.rasterized
+			  << ", culled by frustum: " << statistics.frustum_culled
+			  << ", by facing: " << statistics.face_culled
+			  << ", zero area: " << statistics.zero_area_culled
+			  << ", no samples: " << statistics.no_samples_culled
+			  << ", fragments: " << statistics.fragments
+			  << ", depth passed: " << statistics.depth_passed << std::endl;
+
+	const auto& result = contexts[last_context];
+	cg::utils::save_resource(*result.render_target, settings->result_path);
+
+	if (settings->save_aovs) {
+		auto aov_path = [&](const std::string& name) {
+			auto path = settings->result_path;
+			return path.replace_filename(path.stem().string() + "_" + name + ".pfm");
+		};
+		cg::utils::save_resource(*result.depth_buffer, aov_path("depth"));
+		cg::utils::save_resource(*result.normal_buffer, aov_path("normal"));
+		cg::utils::save_resource(*result.albedo_buffer, aov_path("albedo"));
+	}
+}
+
+cg::renderer::rasterization_renderer::frame_context cg::renderer::rasterization_renderer::create_context() const
+{
+	frame_context context;
+	context.render_target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
+	context.depth_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height);
+	context.rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
+
+	auto& rasterizer = context.rasterizer;
+	rasterizer->set_viewport(settings->width, settings->height);
+	rasterizer->set_render_target(context.render_target, context.depth_buffer);
+	rasterizer->set_sample_count(settings->msaa_samples);
 
-		GifWriteFrame(&gif, rgba.data(), width, height, 10);
+	if (settings->visibility_shading) {
+		context.visibility_buffer = std::make_shared<cg::resource<cg::visibility>>(settings->width, settings->height);
+		rasterizer->set_visibility_buffer(context.visibility_buffer);
+		rasterizer->set_visibility_shading(true);
 	}
 
-	GifEnd(&gif);
-	cg::utils::save_resource(*render_target, settings->result_path);
+	if (settings->save_aovs) {
+		context.normal_buffer = std::make_shared<cg::resource<float3>>(settings->width, settings->height);
+		context.albedo_buffer = std::make_shared<cg::resource<float3>>(settings->width, settings->height);
+		rasterizer->set_output_target(0, context.normal_buffer);
+		rasterizer->set_output_target(1, context.albedo_buffer);
+	}
+	return context;
+}
+
+double cg::renderer::rasterization_renderer::render_frame(frame_context& context, const float4x4& matrix) const
+{
+	auto& rasterizer = context.rasterizer;
+	auto start = std::chrono::high_resolution_clock ::now();
+	rasterizer->clear_render_target({0, 0, 0});
+	auto end = std::chrono::high_resolution_clock ::now();
+	auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+
+	rasterizer->set_transform(matrix);
+	// Shapes entirely outside the view never reach vertex processing
+	auto view_frustum = cg::world::frustum::from_matrix(matrix);
+	std::vector<cg::draw_range> ranges;
+	for (size_t shape_id: get_draw_order(matrix)) {
+		if (view_frustum.intersects(model->get_shape_bounds()[shape_id])) {
+			ranges.push_back(get_lod_range(shape_id, matrix));
+		}
+	}
+	rasterizer->set_vertex_buffer(model->get_merged_vertex_buffer());
+	rasterizer->set_index_buffer(model->get_merged_index_buffer());
+	rasterizer->multi_draw(ranges);
+	rasterizer->shade_visibility();
+	rasterizer->resolve();
+
+	return double(time.count()) / 1000.0;
+}
+
+std::vector<size_t> cg::renderer::rasterization_renderer::get_draw_order(const float4x4& matrix) const
+{
+	const auto& shape_bounds = model->get_shape_bounds();
+	std::vector<size_t> order(shape_bounds.size());
+	std::iota(order.begin(), order.end(), size_t(0));
+	if (!settings->front_to_back) {
+		return order;
+	}
+
+	// Near shapes fill the depth buffer first, so Hi-Z rejects the occluded ones early
+	std::vector<float> distances(shape_bounds.size());
+	for (size_t i = 0; i < shape_bounds.size(); ++i) {
+		distances[i] = mul(matrix, float4{shape_bounds[i].sphere_center, 1.f}).w;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return distances[a] < distances[b];
+	});
+	return order;
+}
+
+cg::draw_range cg::renderer::rasterization_renderer::get_lod_range(size_t shape_id, const float4x4& matrix) const
+{
+	const auto& lods = model->get_shape_lods()[shape_id];
+	const auto& bounds = model->get_shape_bounds()[shape_id];
+	float distance = mul(matrix, float4{bounds.sphere_center, 1.f}).w - bounds.sphere_radius;
+	if (settings->lod_pixel_error <= 0.f || distance <= 0.f) {
+		return lods[0].range;
+	}
+
+	// An error at the nearest point of the bounding sphere covers at most this many pixels per model unit
+	float pixels_per_unit = camera->get_projection_matrix()[1][1] * 0.5f * float(settings->height) / distance;
+	for (size_t level = lods.size() - 1; level > 0; --level) {
+		if (lods[level].error * pixels_per_unit <= settings->lod_pixel_error) {
+			return lods[level].range;
+		}
+	}
+	return lods[0].range;
 }
 
 void cg::renderer::rasterization_renderer::destroy() {}
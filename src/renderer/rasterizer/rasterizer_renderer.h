@@ -15,9 +15,27 @@ namespace cg::renderer
 		virtual void render();
 
 	protected:
-		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
-		std::shared_ptr<cg::resource<float>> depth_buffer;
+		// Rasterizer with its own targets, frames in flight share only the model buffers
+		struct frame_context
+		{
+			std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
+			std::shared_ptr<cg::resource<float>> depth_buffer;
+			std::shared_ptr<cg::resource<cg::visibility>> visibility_buffer;
+			// Written in the same pass as the color when AOVs are requested
+			std::shared_ptr<cg::resource<float3>> normal_buffer;
+			std::shared_ptr<cg::resource<float3>> albedo_buffer;
 
-		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+			std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+		};
+		std::vector<frame_context> contexts;
+
+		frame_context create_context() const;
+		// Returns the clearing time in milliseconds
+		double render_frame(frame_context& context, const float4x4& matrix) const;
+
+		// Front-to-back by the distance to the shapes' bounding sphere centres
+		std::vector<size_t> get_draw_order(const float4x4& matrix) const;
+		// Coarsest level of detail whose error stays within `lod_pixel_error` on screen
+		cg::draw_range get_lod_range(size_t shape_id, const float4x4& matrix) const;
 	};
 }// namespace cg::renderer
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "denoiser.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+
+using namespace cg::renderer;
+
+void cg::renderer::denoiser::set_viewport(size_t in_width, size_t in_height)
+{
+	width = in_width;
+	height = in_height;
+
+	size_t count = width * height;
+	for (size_t channel = 0; channel < 3; ++channel) {
+		color[channel].resize(count);
+		filtered[channel].resize(count);
+		albedo[channel].resize(count);
+		normal[channel].resize(count);
+	}
+	depth.resize(count);
+}
+
+void cg::renderer::denoiser::set_iterations(size_t in_iterations)
+{
+	iterations = in_iterations;
+}
+
+void cg::renderer::denoiser::denoise(
+		cg::resource<float3>& in_color,
+		cg::resource<float3>& in_albedo,
+		cg::resource<float3>& in_normal,
+		cg::resource<float>& in_depth,
+		cg::resource<float3>& out_color)
+{
+	const int count = int(width * height);
+
+#pragma omp parallel for
+	for (int i = 0; i < count; ++i) {
+		for (int channel = 0; channel < 3; ++channel) {
+			color[channel][i] = in_color.item(i)[channel];
+			albedo[channel][i] = in_albedo.item(i)[channel];
+			normal[channel][i] = in_normal.item(i)[channel];
+		}
+		depth[i] = in_depth.item(i);
+	}
+
+	float color_phi = sigma_color;
+	for (size_t iteration = 0; iteration < iterations; ++iteration) {
+		filter_pass(1 << iteration, color_phi);
+		color_phi *= 0.5f;
+	}
+
+#pragma omp parallel for
+	for (int i = 0; i < count; ++i) {
+		out_color.item(i) = float3{color[0][i], color[1][i], color[2][i]};
+	}
+}
+
+void cg::renderer::denoiser::filter_pass(int step_width, float color_phi)
+{
+	static constexpr float kernel[5] = {1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+
+	const int w = int(width);
+	const int h = int(height);
+	const float inv_color_phi = 1.f / (color_phi * color_phi);
+	const float inv_albedo_phi = 1.f / (sigma_albedo * sigma_albedo);
+	const float depth_phi = sigma_depth * float(step_width);
+
+	const float* color_r = color[0].data();
+	const float* color_g = color[1].data();
+	const float* color_b = color[2].data();
+	const float* albedo_r = albedo[0].data();
+	const float* albedo_g = albedo[1].data();
+	const float* albedo_b = albedo[2].data();
+	const float* normal_x = normal[0].data();
+	const float* normal_y = normal[1].data();
+	const float* normal_z = normal[2].data();
+	const float* z = depth.data();
+
+#pragma omp parallel
+	{
+		std::vector<float> sum_r(width);
+		std::vector<float> sum_g(width);
+		std::vector<float> sum_b(width);
+		std::vector<float> sum_w(width);
+
+#pragma omp for
+		for (int y = 0; y < h; ++y) {
+			std::fill(sum_r.begin(), sum_r.end(), 0.f);
+			std::fill(sum_g.begin(), sum_g.end(), 0.f);
+			std::fill(sum_b.begin(), sum_b.end(), 0.f);
+			std::fill(sum_w.begin(), sum_w.end(), 0.f);
+
+			const ptrdiff_t row = ptrdiff_t(y) * w;
+			for (int j = -2; j <= 2; ++j) {
+				int tap_y = y + j * step_width;
+				if (tap_y < 0 || tap_y >= h) {
+					continue;
+				}
+				const ptrdiff_t tap_row = ptrdiff_t(tap_y) * w;
+
+				for (int i = -2; i <= 2; ++i) {
+					const int dx = i * step_width;
+					const int x_begin = std::max(0, -dx);
+					const int x_end = std::min(w, w - dx);
+					const float k = kernel[i + 2] * kernel[j + 2];
+
+#pragma omp simd
+					for (int x = x_begin; x < x_end; ++x) {
+						const ptrdiff_t p = row + x;
+						const ptrdiff_t q = tap_row + x + dx;
+
+						float dr = color_r[p] - color_r[q];
+						float dg = color_g[p] - color_g[q];
+						float db = color_b[p] - color_b[q];
+						float color_distance = dr * dr + dg * dg + db * db;
+
+						float ar = albedo_r[p] - albedo_r[q];
+						float ag = albedo_g[p] - albedo_g[q];
+						float ab = albedo_b[p] - albedo_b[q];
+						float albedo_distance = ar * ar + ag * ag + ab * ab;
+
+						float depth_distance = std::abs(z[p] - z[q]) / (depth_phi * std::min(z[p], z[q]) + 1e-4f);
+
+						// max(dot(n_p, n_q), 0)^32
+						float normal_weight = std::max(normal_x[p] * normal_x[q] + normal_y[p] * normal_y[q] + normal_z[p] * normal_z[q], 0.f);
+						normal_weight *= normal_weight;
+						normal_weight *= normal_weight;
+						normal_weight *= normal_weight;
+						normal_weight *= normal_weight;
+						normal_weight *= normal_weight;
+
+						float weight = k * normal_weight * std::exp(-color_distance * inv_color_phi - albedo_distance * inv_albedo_phi - depth_distance);
+
+						sum_r[x] += weight * color_r[q];
+						sum_g[x] += weight * color_g[q];
+						sum_b[x] += weight * color_b[q];
+						sum_w[x] += weight;
+					}
+				}
+			}
+
+			// Background pixels have no geometry to guide the filter, so they pass through, as do
+			// pixels whose degenerate normal rejects even the centre tap
+			for (int x = 0; x < w; ++x) {
+				const ptrdiff_t p = row + x;
+				bool keep = z[p] == std::numeric_limits<float>::max() || !(sum_w[x] > 0.f);
+				filtered[0][p] = keep ? color_r[p] : sum_r[x] / sum_w[x];
+				filtered[1][p] = keep ? color_g[p] : sum_g[x] / sum_w[x];
+				filtered[2][p] = keep ? color_b[p] : sum_b[x] / sum_w[x];
+			}
+		}
+	}
+
+	for (size_t channel = 0; channel < 3; ++channel) {
+		std::swap(color[channel], filtered[channel]);
+	}
+}
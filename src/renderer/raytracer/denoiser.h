@@ -0,0 +1,48 @@
+#pragma once
+
+#include "resource.h"
+
+#include <linalg.h>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// Edge-avoiding a-trous wavelet filter guided by first-hit albedo, normal and depth.
+	// Buffers are split into planes, so every kernel tap is a contiguous SIMD loop.
+	class denoiser
+	{
+	public:
+		denoiser() {};
+		~denoiser() {};
+
+		void set_viewport(size_t in_width, size_t in_height);
+		void set_iterations(size_t in_iterations);
+
+		void denoise(
+				cg::resource<float3>& in_color,
+				cg::resource<float3>& in_albedo,
+				cg::resource<float3>& in_normal,
+				cg::resource<float>& in_depth,
+				cg::resource<float3>& out_color);
+
+		float sigma_color = 0.6f;
+		float sigma_albedo = 0.1f;
+		float sigma_depth = 0.1f;
+
+	protected:
+		void filter_pass(int step_width, float color_phi);
+
+		size_t width = 1920;
+		size_t height = 1080;
+		size_t iterations = 5;
+
+		std::vector<float> color[3];
+		std::vector<float> filtered[3];
+		std::vector<float> albedo[3];
+		std::vector<float> normal[3];
+		std::vector<float> depth;
+	};
+}// namespace cg::renderer
@@ -1,12 +1,17 @@
 #pragma once
 
+#include "renderer/raytracer/denoiser.h"
 #include "resource.h"
+#include "world/frustum.h"
 
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <linalg.h>
 #include <memory>
 #include <omp.h>
 #include <random>
+#include <type_traits>
 #include <utility>
 
 using namespace linalg::aliases;
@@ -21,6 +26,8 @@ namespace cg::renderer
 		}
 		float3 position;
 		float3 direction;
+		// Angle a pixel subtends, for texture LOD from the ray cone's width at a hit
+		float spread_angle = 0.f;
 	};
 
 	struct payload
@@ -28,6 +35,10 @@ namespace cg::renderer
 		float t;
 		float3 bary;
 		cg::color color;
+
+		float3 normal;
+		float3 albedo;
+		unsigned int primitive_id;
 	};
 
 	template<typename VB>
@@ -49,6 +60,13 @@ namespace cg::renderer
 		float3 ambient;
 		float3 diffuse;
 		float3 emissive;
+
+		float2 ta;
+		float2 tb;
+		float2 tc;
+		unsigned int texture_id;
+
+		unsigned int primitive_id = 0;
 	};
 
 	template<typename VB>
@@ -69,6 +87,11 @@ namespace cg::renderer
 		ambient = vertex_a.ambient;
 		diffuse = vertex_a.diffuse;
 		emissive = vertex_a.emissive;
+
+		ta = vertex_a.texture;
+		tb = vertex_b.texture;
+		tc = vertex_c.texture;
+		texture_id = vertex_a.texture_id;
 	}
 
 	template<typename VB>
@@ -78,6 +101,7 @@ namespace cg::renderer
 		void add_triangle(const triangle<VB> triangle);
 		const std::vector<triangle<VB>>& get_triangles() const;
 		bool aabb_test(const ray& ray) const;
+		cg::shape_bounds get_bounds() const;
 
 	protected:
 		std::vector<triangle<VB>> triangles;
@@ -92,7 +116,45 @@ namespace cg::renderer
 		float3 color;
 	};
 
-	template<typename VB, typename RT>
+	// Arbitrary output variables filled from the first hit of primary rays.
+	// `depth`, `normal` and `albedo` are always present, the rest are written only when bound.
+	struct aov_buffers
+	{
+		std::shared_ptr<cg::resource<float>> depth;
+		std::shared_ptr<cg::resource<float3>> normal;
+		std::shared_ptr<cg::resource<float3>> albedo;
+		std::shared_ptr<cg::resource<unsigned int>> primitive_id;
+		std::shared_ptr<cg::resource<unsigned int>> sample_count;
+	};
+
+	// Camera basis used by `ray_generation`
+	struct camera_basis
+	{
+		float3 position;
+		float3 direction;
+		float3 right;
+		float3 up;
+	};
+
+	// Placeholder for a shader stage that is not bound at compile time
+	struct no_shader
+	{
+	};
+
+	using miss_shader_function = std::function<payload(const ray& ray)>;
+	template<typename VB>
+	using closest_hit_shader_function =
+			std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>;
+	template<typename VB>
+	using any_hit_shader_function =
+			std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle)>;
+
+	// Shaders are template parameters, so functor types are inlined into the traversal.
+	// The default `std::function` types keep the runtime-assignable form.
+	template<typename VB, typename RT,
+			 typename MS = miss_shader_function,
+			 typename CHS = closest_hit_shader_function<VB>,
+			 typename AHS = any_hit_shader_function<VB>>
 	class raytracer
 	{
 	public:
@@ -102,6 +164,10 @@ namespace cg::renderer
 		void set_render_target(std::shared_ptr<resource<RT>> in_render_target);
 		void clear_render_target(const RT& in_clear_value);
 		void set_viewport(size_t in_width, size_t in_height);
+		void set_denoiser(std::shared_ptr<cg::renderer::denoiser> in_denoiser);
+		void set_aov_buffers(const aov_buffers& in_aov_buffers);
+		const aov_buffers& get_aov_buffers() const;
+		void set_temporal_reprojection(bool in_enabled, size_t in_max_history_length = 64);
 
 		void set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers);
 		void set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers);
@@ -109,15 +175,18 @@ namespace cg::renderer
 		std::vector<aabb<VB>> acceleration_structures;
 
 		void ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num);
+		// Starts from rasterized primary visibility and traces only secondary rays
+		void ray_generation(float3 position, float3 direction, float3 right, float3 up,
+							cg::resource<cg::visibility>& visibility_buffer, size_t depth, size_t accumulation_num);
 
-		payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
+		// Only the acceleration structures listed in `shape_ids` are tested when it is given
+		payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f,
+						  const std::vector<unsigned int>* shape_ids = nullptr) const;
 		payload intersection_shader(const triangle<VB>& triangle, const ray& ray) const;
 
-		std::function<payload(const ray& ray)> miss_shader = nullptr;
-		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>
-				closest_hit_shader = nullptr;
-		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle)> any_hit_shader =
-				nullptr;
+		MS miss_shader{};
+		CHS closest_hit_shader{};
+		AHS any_hit_shader{};
 
 		float2 get_jitter(int frame_id);
 
@@ -128,51 +197,133 @@ namespace cg::renderer
 		std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
 		std::vector<triangle<VB>> triangles;
 
+		std::shared_ptr<cg::renderer::denoiser> denoiser;
+		aov_buffers aov;
+
+		bool temporal_reprojection = false;
+		bool has_previous_frame = false;
+		size_t max_history_length = 64;
+		camera_basis previous_camera;
+		std::shared_ptr<cg::resource<float3>> previous_history;
+		std::shared_ptr<cg::resource<float>> previous_depth;
+		std::shared_ptr<cg::resource<float3>> previous_normal;
+		std::shared_ptr<cg::resource<unsigned int>> history_length;
+		std::shared_ptr<cg::resource<unsigned int>> previous_history_length;
+
 		size_t width = 1920;
 		size_t height = 1080;
+
+		float3 get_ray_direction(const camera_basis& camera, float x, float y, float2 jitter) const;
+		float get_spread_angle(const camera_basis& camera) const;
+		std::vector<unsigned int> get_primary_shapes(const camera_basis& camera) const;
+		void reproject(const camera_basis& camera, float2 jitter, size_t accumulation_num);
+		void write_first_hit(int x, int y, const payload& payload);
+		void resolve();
+		// A miss without a bound miss shader returns the default payload
+		payload miss(const ray& ray) const;
+
+		template<typename S>
+		static bool is_bound(const S& shader);
 	};
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_render_target(
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_render_target(
 			std::shared_ptr<resource<RT>> in_render_target)
 	{
 		render_target = in_render_target;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_viewport(size_t in_width,
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_viewport(size_t in_width,
 												size_t in_height)
 	{
 		height = in_height;
 		width = in_width;
 		history = std::make_shared<cg::resource<float3>>(width, height);
+		aov.depth = std::make_shared<cg::resource<float>>(width, height);
+		aov.normal = std::make_shared<cg::resource<float3>>(width, height);
+		aov.albedo = std::make_shared<cg::resource<float3>>(width, height);
+		previous_history = std::make_shared<cg::resource<float3>>(width, height);
+		previous_depth = std::make_shared<cg::resource<float>>(width, height);
+		previous_normal = std::make_shared<cg::resource<float3>>(width, height);
+		history_length = std::make_shared<cg::resource<unsigned int>>(width, height);
+		previous_history_length = std::make_shared<cg::resource<unsigned int>>(width, height);
+		has_previous_frame = false;
+		if (denoiser) {
+			denoiser->set_viewport(width, height);
+		}
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_denoiser(
+			std::shared_ptr<cg::renderer::denoiser> in_denoiser)
+	{
+		denoiser = in_denoiser;
+		if (denoiser) {
+			denoiser->set_viewport(width, height);
+		}
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_aov_buffers(const aov_buffers& in_aov_buffers)
+	{
+		if (in_aov_buffers.depth) {
+			aov.depth = in_aov_buffers.depth;
+		}
+		if (in_aov_buffers.normal) {
+			aov.normal = in_aov_buffers.normal;
+		}
+		if (in_aov_buffers.albedo) {
+			aov.albedo = in_aov_buffers.albedo;
+		}
+		aov.primitive_id = in_aov_buffers.primitive_id;
+		aov.sample_count = in_aov_buffers.sample_count;
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline const aov_buffers& raytracer<VB, RT, MS, CHS, AHS>::get_aov_buffers() const
+	{
+		return aov;
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_temporal_reprojection(
+			bool in_enabled, size_t in_max_history_length)
+	{
+		temporal_reprojection = in_enabled;
+		max_history_length = in_max_history_length;
+		has_previous_frame = false;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::clear_render_target(
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::clear_render_target(
 			const RT& in_clear_value)
 	{
 		for (size_t i = 0; i < render_target->count(); ++i) {
 			render_target->item(i) = in_clear_value;
 			history->item(i) = float3{0.0f, 0.0f, 0.0f};
+			if (aov.sample_count) {
+				aov.sample_count->item(i) = 0;
+			}
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
 	{
 		vertex_buffers = std::move(in_vertex_buffers);
 	}
 
-	template<typename VB, typename RT>
-	void raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	void raytracer<VB, RT, MS, CHS, AHS>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
 	{
 		index_buffers = std::move(in_index_buffers);
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::build_acceleration_structure()
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::build_acceleration_structure()
 	{
+		unsigned int primitive_id = 0;
 		for (size_t shape_id = 0; shape_id < index_buffers.size(); ++shape_id) {
 			const auto& index_buffer = index_buffers[shape_id];
 			const auto& vertex_buffer = vertex_buffers[shape_id];
@@ -181,10 +332,12 @@ namespace cg::renderer
 			aabb<VB> aabb;
 
 			while (index_id < index_buffer->count()) {
-				triangle<VB> triangle(
-						vertex_buffer->item(index_buffer->item(index_id++)),
-						vertex_buffer->item(index_buffer->item(index_id++)),
-						vertex_buffer->item(index_buffer->item(index_id++)));
+				// Keep the index order, so vertices match the rasterizer's triangle assembly
+				const VB& vertex_a = vertex_buffer->item(index_buffer->item(index_id++));
+				const VB& vertex_b = vertex_buffer->item(index_buffer->item(index_id++));
+				const VB& vertex_c = vertex_buffer->item(index_buffer->item(index_id++));
+				triangle<VB> triangle(vertex_a, vertex_b, vertex_c);
+				triangle.primitive_id = primitive_id++;
 				aabb.add_triangle(triangle);
 			}
 
@@ -192,44 +345,244 @@ namespace cg::renderer
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::ray_generation(
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::ray_generation(
 			float3 position, float3 direction,
 			float3 right, float3 up, size_t depth, size_t accumulation_num)
 	{
+		camera_basis camera{position, direction, right, up};
 		float frame_weight = 1.0f / float(accumulation_num);
+		const float spread_angle = get_spread_angle(camera);
+		const std::vector<unsigned int> primary_shapes = get_primary_shapes(camera);
 		for (int frame_id = 0; frame_id < accumulation_num; ++frame_id) {
 			std::cout << "Tracing frame #" << frame_id + 1 << std::endl;
 			float2 jitter = get_jitter(frame_id);
 #pragma omp parallel for
 			for (int x = 0; x < width; ++x) {
 				for (int y = 0; y < height; ++y) {
-					float u = (2.0f * float(x) + jitter.x) / float(width - 1) - 1.0f;
-					float v = (2.0f * float(y) + jitter.y) / float(height - 1) - 1.0f;
-					u *= float(width) / float(height);
+					ray ray(position, get_ray_direction(camera, float(x), float(y), jitter));
+					ray.spread_angle = spread_angle;
+
+					payload payload = trace_ray(ray, depth, 1000.f, 0.001f, &primary_shapes);
 
-					float3 ray_direction = direction + u * right - v * up;
-					ray ray(position, ray_direction);
+					auto& history_pixel = history->item(x, y);
+					history_pixel += sqrt(payload.color.to_float3() * frame_weight);
+
+					if (frame_id == 0) {
+						write_first_hit(x, y, payload);
+					}
+					if (aov.sample_count) {
+						aov.sample_count->item(x, y)++;
+					}
+				}
+			}
+		}
+
+		if (temporal_reprojection) {
+			reproject(camera, get_jitter(0), accumulation_num);
+		}
+
+		resolve();
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::ray_generation(
+			float3 position, float3 direction, float3 right, float3 up,
+			cg::resource<cg::visibility>& visibility_buffer, size_t depth, size_t accumulation_num)
+	{
+		camera_basis camera{position, direction, right, up};
+		float frame_weight = 1.0f / float(accumulation_num);
+		const float spread_angle = get_spread_angle(camera);
+		for (int frame_id = 0; frame_id < accumulation_num; ++frame_id) {
+			std::cout << "Shading frame #" << frame_id + 1 << std::endl;
+#pragma omp parallel for
+			for (int x = 0; x < width; ++x) {
+				for (int y = 0; y < height; ++y) {
+					const cg::visibility& sample = visibility_buffer.item(x, y);
 
-					payload payload = trace_ray(ray, depth);
+					payload payload{};
+					if (depth == 0 || sample.primitive_id == cg::visibility::invalid_id) {
+						payload = miss(ray(position, get_ray_direction(camera, float(x), float(y), float2{0.f, 0.f})));
+					}
+					else {
+						const auto& triangle = acceleration_structures[sample.draw_id].get_triangles()[sample.primitive_id];
+						float3 hit_position = sample.bary.x * triangle.a + sample.bary.y * triangle.b + sample.bary.z * triangle.c;
+						ray primary_ray(position, hit_position - position);
+						primary_ray.spread_angle = spread_angle;
+
+						payload.t = length(hit_position - position);
+						payload.bary = sample.bary;
+						payload.normal = normalize(
+								sample.bary.x * triangle.na +
+								sample.bary.y * triangle.nb +
+								sample.bary.z * triangle.nc);
+						payload.albedo = triangle.diffuse;
+						payload.primitive_id = triangle.primitive_id;
+
+						if constexpr (!std::is_same_v<CHS, no_shader>) {
+							if (is_bound(closest_hit_shader)) {
+								payload = closest_hit_shader(primary_ray, payload, triangle, depth - 1);
+							}
+						}
+					}
 
 					auto& history_pixel = history->item(x, y);
 					history_pixel += sqrt(payload.color.to_float3() * frame_weight);
 
-					if (frame_id == accumulation_num - 1) {
-						render_target->item(x, y) = RT::from_float3(history_pixel);
+					if (frame_id == 0) {
+						write_first_hit(x, y, payload);
+					}
+					if (aov.sample_count) {
+						aov.sample_count->item(x, y)++;
+					}
+				}
+			}
+		}
+
+		resolve();
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::write_first_hit(int x, int y, const payload& payload)
+	{
+		bool hit = payload.t > 0.f;
+		aov.albedo->item(x, y) = payload.albedo;
+		aov.normal->item(x, y) = payload.normal;
+		aov.depth->item(x, y) = hit ? payload.t : std::numeric_limits<float>::max();
+		if (aov.primitive_id) {
+			aov.primitive_id->item(x, y) = hit ? payload.primitive_id : std::numeric_limits<unsigned int>::max();
+		}
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::resolve()
+	{
+		if (denoiser) {
+			std::cout << "Denoising" << std::endl;
+			cg::resource<float3> denoised(width, height);
+			denoiser->denoise(*history, *aov.albedo, *aov.normal, *aov.depth, denoised);
+			for (size_t i = 0; i < render_target->count(); ++i) {
+				render_target->item(i) = RT::from_float3(denoised.item(i));
+			}
+		}
+		else {
+			for (size_t i = 0; i < render_target->count(); ++i) {
+				render_target->item(i) = RT::from_float3(history->item(i));
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline float3 raytracer<VB, RT, MS, CHS, AHS>::get_ray_direction(
+			const camera_basis& camera, float x, float y, float2 jitter) const
+	{
+		float u = (2.0f * x + jitter.x) / float(width - 1) - 1.0f;
+		float v = (2.0f * y + jitter.y) / float(height - 1) - 1.0f;
+		u *= float(width) / float(height);
+
+		return camera.direction + u * camera.right - v * camera.up;
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline float raytracer<VB, RT, MS, CHS, AHS>::get_spread_angle(const camera_basis& camera) const
+	{
+		// Neighbouring rows of `get_ray_direction` are `2 / (height - 1)` of `up` apart
+		return 2.0f * length(camera.up) / (float(height - 1) * length(camera.direction));
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline std::vector<unsigned int> raytracer<VB, RT, MS, CHS, AHS>::get_primary_shapes(const camera_basis& camera) const
+	{
+		// Jitter moves rays by less than a pixel, so corners one pixel outside the image bound all of them
+		const float3 corners[4] = {
+				get_ray_direction(camera, -1.f, -1.f, float2{0.f, 0.f}),
+				get_ray_direction(camera, float(width), -1.f, float2{0.f, 0.f}),
+				get_ray_direction(camera, float(width), float(height), float2{0.f, 0.f}),
+				get_ray_direction(camera, -1.f, float(height), float2{0.f, 0.f}),
+		};
+		auto view_frustum = cg::world::frustum::from_corners(camera.position, corners);
+
+		std::vector<unsigned int> shape_ids;
+		for (size_t shape_id = 0; shape_id < acceleration_structures.size(); ++shape_id) {
+			const auto& aabb = acceleration_structures[shape_id];
+			if (!aabb.get_triangles().empty() && view_frustum.intersects(aabb.get_bounds())) {
+				shape_ids.push_back(unsigned(shape_id));
+			}
+		}
+		return shape_ids;
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::reproject(
+			const camera_basis& camera, float2 jitter, size_t accumulation_num)
+	{
+		const camera_basis& previous = previous_camera;
+		const bool reuse = has_previous_frame;
+
+#pragma omp parallel for
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				unsigned int samples = unsigned(accumulation_num);
+				float t = aov.depth->item(x, y);
+
+				if (reuse && t != std::numeric_limits<float>::max()) {
+					float3 world_position = camera.position + normalize(get_ray_direction(camera, float(x), float(y), jitter)) * t;
+
+					// Invert `get_ray_direction` for the previous camera basis
+					float3 offset = world_position - previous.position;
+					float forward = dot(offset, previous.direction) / dot(previous.direction, previous.direction);
+					if (forward > 0.f) {
+						float u = dot(offset, previous.right) / dot(previous.right, previous.right) / forward;
+						float v = -dot(offset, previous.up) / dot(previous.up, previous.up) / forward;
+						u *= float(height) / float(width);
+
+						int previous_x = int(std::floor((u + 1.0f) * float(width - 1) / 2.0f + 0.5f));
+						int previous_y = int(std::floor((v + 1.0f) * float(height - 1) / 2.0f + 0.5f));
+
+						if (previous_x >= 0 && previous_x < width && previous_y >= 0 && previous_y < height) {
+							float expected_t = length(offset);
+							float stored_t = previous_depth->item(previous_x, previous_y);
+							float normal_similarity = dot(previous_normal->item(previous_x, previous_y), aov.normal->item(x, y));
+
+							// Reject disocclusions by depth and normal mismatch
+							if (std::abs(stored_t - expected_t) < 0.05f * expected_t && normal_similarity > 0.9f) {
+								unsigned int previous_length = std::min(
+										previous_history_length->item(previous_x, previous_y),
+										unsigned(max_history_length > accumulation_num ? max_history_length - accumulation_num : 0));
+								float alpha = float(accumulation_num) / float(accumulation_num + previous_length);
+
+								auto& history_pixel = history->item(x, y);
+								history_pixel = lerp(previous_history->item(previous_x, previous_y), history_pixel, alpha);
+								samples += previous_length;
+							}
+						}
 					}
 				}
+
+				history_length->item(x, y) = samples;
+				if (aov.sample_count) {
+					aov.sample_count->item(x, y) = samples;
+				}
 			}
 		}
+
+		for (size_t i = 0; i < history->count(); ++i) {
+			previous_history->item(i) = history->item(i);
+			previous_depth->item(i) = aov.depth->item(i);
+			previous_normal->item(i) = aov.normal->item(i);
+		}
+		std::swap(history_length, previous_history_length);
+		previous_camera = camera;
+		has_previous_frame = true;
 	}
 
-	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::trace_ray(
-			const ray& ray, size_t depth, float max_t, float min_t) const
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline payload raytracer<VB, RT, MS, CHS, AHS>::trace_ray(
+			const ray& ray, size_t depth, float max_t, float min_t,
+			const std::vector<unsigned int>* shape_ids) const
 	{
 		if (depth == 0) {
-			return miss_shader(ray);
+			return miss(ray);
 		}
 		depth--;
 
@@ -237,7 +590,9 @@ namespace cg::renderer
 		closest_hit_payload.t = max_t;
 		const triangle<VB>* closest_triangle = nullptr;
 
-		for (const auto& aabb: acceleration_structures) {
+		const size_t num_shapes = shape_ids ? shape_ids->size() : acceleration_structures.size();
+		for (size_t i = 0; i < num_shapes; ++i) {
+			const auto& aabb = acceleration_structures[shape_ids ? (*shape_ids)[i] : i];
 			if (!aabb.aabb_test(ray)) {
 				continue;
 			}
@@ -248,24 +603,46 @@ namespace cg::renderer
 					closest_hit_payload = payload;
 					closest_triangle = &triangle;
 
-					if (any_hit_shader) {
-						return any_hit_shader(ray, payload, triangle);
+					if constexpr (!std::is_same_v<AHS, no_shader>) {
+						if (is_bound(any_hit_shader)) {
+							return any_hit_shader(ray, payload, triangle);
+						}
 					}
 				}
 			}
 		}
 
 		if (closest_triangle) {
-			if (closest_hit_shader) {
-				return closest_hit_shader(ray, closest_hit_payload, *closest_triangle, depth);
+			closest_hit_payload.normal = normalize(
+					closest_hit_payload.bary.x * closest_triangle->na +
+					closest_hit_payload.bary.y * closest_triangle->nb +
+					closest_hit_payload.bary.z * closest_triangle->nc);
+			closest_hit_payload.albedo = closest_triangle->diffuse;
+			closest_hit_payload.primitive_id = closest_triangle->primitive_id;
+
+			if constexpr (!std::is_same_v<CHS, no_shader>) {
+				if (is_bound(closest_hit_shader)) {
+					return closest_hit_shader(ray, closest_hit_payload, *closest_triangle, depth);
+				}
 			}
 		}
 
-		return miss_shader(ray);
+		return miss(ray);
 	}
 
-	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::intersection_shader(
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline payload raytracer<VB, RT, MS, CHS, AHS>::miss(const ray& ray) const
+	{
+		if constexpr (!std::is_same_v<MS, no_shader>) {
+			return miss_shader(ray);
+		}
+		else {
+			return payload{};
+		}
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline payload raytracer<VB, RT, MS, CHS, AHS>::intersection_shader(
 			const triangle<VB>& triangle, const ray& ray) const
 	{
 		payload payload{};
@@ -296,8 +673,8 @@ namespace cg::renderer
 		return payload;
 	}
 
-	template<typename VB, typename RT>
-	float2 raytracer<VB, RT>::get_jitter(int frame_id)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	float2 raytracer<VB, RT, MS, CHS, AHS>::get_jitter(int frame_id)
 	{
 		float2 results{0.0f, 0.0f};
 
@@ -326,6 +703,18 @@ namespace cg::renderer
 		return results - 0.5f;
 	}
 
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	template<typename S>
+	inline bool raytracer<VB, RT, MS, CHS, AHS>::is_bound(const S& shader)
+	{
+		if constexpr (std::is_constructible_v<bool, const S&>) {
+			return static_cast<bool>(shader);
+		}
+		else {
+			return true;
+		}
+	}
+
 
 	template<typename VB>
 	inline void aabb<VB>::add_triangle(const triangle<VB> triangle)
@@ -364,4 +753,15 @@ namespace cg::renderer
 		return maxelem(t_min) <= minelem(t_max);
 	}
 
+	template<typename VB>
+	inline cg::shape_bounds aabb<VB>::get_bounds() const
+	{
+		cg::shape_bounds bounds;
+		bounds.aabb_min = aabb_min;
+		bounds.aabb_max = aabb_max;
+		bounds.sphere_center = (aabb_min + aabb_max) * 0.5f;
+		bounds.sphere_radius = length(aabb_max - aabb_min) * 0.5f;
+		return bounds;
+	}
+
 }// namespace cg::renderer
\ No newline at end of file
@@ -9,6 +9,7 @@ void cg::renderer::ray_tracing_renderer::init()
 {
 	model = std::make_shared<cg::world::model>();
 	model->load_obj(settings->model_path);
+	model->load_textures();
 
 	camera = std::make_shared<cg::world::camera>();
 	camera->set_height(float(settings->height));
@@ -26,69 +27,136 @@ void cg::renderer::ray_tracing_renderer::init()
 
 	render_target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
 
-	raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+	raytracer = std::make_shared<cg::renderer::path_tracer>();
 	raytracer->set_render_target(render_target);
 	raytracer->set_viewport(settings->width, settings->height);
 	raytracer->set_index_buffers(model->get_index_buffers());
 	raytracer->set_vertex_buffers(model->get_vertex_buffers());
+	raytracer->closest_hit_shader.textures = model->get_textures();
+
+	if (settings->denoiser_iterations > 0) {
+		auto denoiser = std::make_shared<cg::renderer::denoiser>();
+		denoiser->set_iterations(settings->denoiser_iterations);
+		raytracer->set_denoiser(denoiser);
+	}
+
+	if (settings->save_aovs) {
+		cg::renderer::aov_buffers aov{};
+		aov.primitive_id = std::make_shared<cg::resource<unsigned int>>(settings->width, settings->height);
+		aov.sample_count = std::make_shared<cg::resource<unsigned int>>(settings->width, settings->height);
+		raytracer->set_aov_buffers(aov);
+	}
 
 	lights.push_back({float3{0.0f, 1.58f, -0.03f},
 					  float3{0.78f, 0.78f, 0.78f}});
 }
 
-void cg::renderer::ray_tracing_renderer::destroy() {}
-
-void cg::renderer::ray_tracing_renderer::update() {}
+cg::renderer::payload cg::renderer::black_miss_shader::operator()(const ray& ray) const
+{
+	payload payload{};
+	payload.color = {0.0f, 0.0f, 0.0f};
+	return payload;
+}
 
-void cg::renderer::ray_tracing_renderer::render()
+cg::renderer::payload cg::renderer::diffuse_hit_shader::operator()(
+		const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth) const
 {
-	raytracer->clear_render_target({0, 0, 0});
-	raytracer->miss_shader = [](const ray& ray) {
-		payload payload{};
-		payload.color = {0.0f, 0.0f, 0.0f};
-		return payload;
-	};
-
-	std::random_device rd;
-	std::mt19937 gen(rd());
+	thread_local std::mt19937 gen(std::random_device{}());
 	std::uniform_real_distribution<float> dis(-1.0f, 1.0f);
 
-	raytracer->closest_hit_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth) {
-		float3 position = ray.position + ray.direction * payload.t;
-		float3 normal = normalize(
-				payload.bary.x * triangle.na +
-				payload.bary.y * triangle.nb +
-				payload.bary.z * triangle.nc);
-
-		float3 result_color = triangle.emissive;
-		float3 random_direction = {dis(gen), dis(gen), dis(gen)};
-		if (dot(normal, random_direction) < 0.0f) {
-			random_direction = -random_direction;
-		}
+	float3 position = ray.position + ray.direction * payload.t;
+	float3 normal = normalize(
+			payload.bary.x * triangle.na +
+			payload.bary.y * triangle.nb +
+			payload.bary.z * triangle.nc);
+
+	float3 result_color = triangle.emissive;
+	float3 random_direction = {dis(gen), dis(gen), dis(gen)};
+	if (dot(normal, random_direction) < 0.0f) {
+		random_direction = -random_direction;
+	}
+
+	float3 albedo = get_albedo(ray, payload, triangle, normal);
+	payload.albedo = albedo;
+
+	// Cones of bounced rays are approximated by the pixel's spread
+	cg::renderer::ray to_next_object(position, random_direction);
+	to_next_object.spread_angle = ray.spread_angle;
+	auto next_payload = tracer->trace_ray(to_next_object, depth);
+	result_color += albedo * next_payload.color.to_float3() * std::max(dot(normal, to_next_object.direction), 0.0f);
+
+	payload.color = cg::color::from_float3(result_color);
+	return payload;
+}
 
-		cg::renderer::ray to_next_object(position, random_direction);
-		auto next_payload = raytracer->trace_ray(to_next_object, depth);
-		result_color += triangle.diffuse * next_payload.color.to_float3() * std::max(dot(normal, to_next_object.direction), 0.0f);
+float3 cg::renderer::diffuse_hit_shader::get_albedo(
+		const ray& ray, const payload& payload, const triangle<cg::vertex>& triangle, const float3& normal) const
+{
+	if (triangle.texture_id >= textures.size()) {
+		return triangle.diffuse;
+	}
+	const auto& texture = *textures[triangle.texture_id];
+
+	// Width of the ray cone at the hit, scaled by the triangle's texture to world area ratio
+	float2 tba = triangle.tb - triangle.ta;
+	float2 tca = triangle.tc - triangle.ta;
+	float texture_area = std::abs(tba.x * tca.y - tba.y * tca.x);
+	float world_area = length(cross(triangle.ba, triangle.ca));
+	float cone_width = payload.t * ray.spread_angle / std::max(std::abs(dot(normal, ray.direction)), 0.01f);
+	float footprint = world_area > 0.f ? cone_width * std::sqrt(texture_area / world_area) : 0.f;
+
+	float2 uv = payload.bary.x * triangle.ta + payload.bary.y * triangle.tb + payload.bary.z * triangle.tc;
+	float lod = texture.get_lod(float2{footprint, 0.f}, float2{0.f, footprint});
+	return triangle.diffuse * texture.sample(uv, lod);
+}
 
-		payload.color = cg::color::from_float3(result_color);
-		return payload;
-	};
-	raytracer->build_acceleration_structure();
+void cg::renderer::ray_tracing_renderer::destroy() {}
 
-	auto start = std::chrono::high_resolution_clock::now();
-	raytracer->ray_generation(
-			camera->get_position(),
-			camera->get_direction(),
-			camera->get_right(),
-			camera->get_up(),
-			settings->raytracing_depth,
-			settings->accumulation_num);
-	auto stop = std::chrono::high_resolution_clock::now();
-	auto time = std::chrono::duration<float, std::milli>(stop - start);
-	std::cout << "Raytacing took " << time.count() << " ms" << std::endl;
+void cg::renderer::ray_tracing_renderer::update() {}
 
-	cg::utils::save_resource(*render_target, settings->result_path);
+void cg::renderer::ray_tracing_renderer::render()
+{
+	raytracer->closest_hit_shader.tracer = raytracer.get();
+	raytracer->build_acceleration_structure();
+	raytracer->set_temporal_reprojection(settings->temporal_reprojection);
+
+	for (unsigned frame_id = 0; frame_id < settings->raytracing_frames; ++frame_id) {
+		camera->set_theta(settings->camera_theta + settings->camera_theta_step * float(frame_id));
+		raytracer->clear_render_target({0, 0, 0});
+
+		auto start = std::chrono::high_resolution_clock::now();
+		raytracer->ray_generation(
+				camera->get_position(),
+				camera->get_direction(),
+				camera->get_right(),
+				camera->get_up(),
+				settings->raytracing_depth,
+				settings->accumulation_num);
+		auto stop = std::chrono::high_resolution_clock::now();
+		auto time = std::chrono::duration<float, std::milli>(stop - start);
+		std::cout << "Raytacing took " << time.count() << " ms" << std::endl;
+
+		auto result_path = settings->result_path;
+		if (settings->raytracing_frames > 1) {
+			result_path.replace_filename(
+					result_path.stem().string() + "_" + std::to_string(frame_id) + result_path.extension().string());
+		}
+		cg::utils::save_resource(*render_target, result_path);
+
+		if (settings->save_aovs) {
+			const auto& aov = raytracer->get_aov_buffers();
+			auto aov_path = [&](const std::string& name) {
+				auto path = result_path;
+				return path.replace_filename(path.stem().string() + "_" + name + ".pfm");
+			};
+			cg::utils::save_resource(*aov.depth, aov_path("depth"));
+			cg::utils::save_resource(*aov.normal, aov_path("normal"));
+			cg::utils::save_resource(*aov.albedo, aov_path("albedo"));
+			cg::utils::save_resource(*aov.primitive_id, aov_path("primitive_id"));
+			cg::utils::save_resource(*aov.sample_count, aov_path("sample_count"));
+		}
+	}
 
 	// TODO Lab: 2.05 Adjust `ray_tracing_renderer` class to build the acceleration structure
 	// TODO Lab: 2.06 (Bonus) Adjust `closest_hit_shader` for Monte-Carlo light tracing
-}
\ No newline at end of file
+}
@@ -1,10 +1,32 @@
+#pragma once
+
 #include "renderer/raytracer/raytracer.h"
 #include "renderer/renderer.h"
 #include "resource.h"
+#include "world/texture.h"
 
 
 namespace cg::renderer
 {
+	struct black_miss_shader
+	{
+		payload operator()(const ray& ray) const;
+	};
+
+	struct diffuse_hit_shader;
+
+	using path_tracer = raytracer<cg::vertex, cg::unsigned_color, black_miss_shader, diffuse_hit_shader, no_shader>;
+
+	struct diffuse_hit_shader
+	{
+		const path_tracer* tracer = nullptr;
+		// Indexed by `triangle::texture_id`
+		std::vector<std::shared_ptr<cg::world::texture>> textures;
+
+		payload operator()(const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth) const;
+		float3 get_albedo(const ray& ray, const payload& payload, const triangle<cg::vertex>& triangle, const float3& normal) const;
+	};
+
 	class ray_tracing_renderer : public renderer
 	{
 	public:
@@ -17,7 +39,7 @@ namespace cg::renderer
 	protected:
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> raytracer;
+		std::shared_ptr<cg::renderer::path_tracer> raytracer;
 		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
 
 		std::vector<cg::renderer::light> lights;
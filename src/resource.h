@@ -129,6 +129,22 @@ namespace cg
 			return {float(r), float(g), float(b)};
 		};
 
+		// Rounded mean of multisampled colors
+		static unsigned_color average(const unsigned_color* colors, size_t count)
+		{
+			unsigned int sum[3] = {0, 0, 0};
+			for (size_t i = 0; i < count; ++i) {
+				sum[0] += colors[i].r;
+				sum[1] += colors[i].g;
+				sum[2] += colors[i].b;
+			}
+			unsigned_color res{};
+			res.r = uint8_t((sum[0] + count / 2) / count);
+			res.g = uint8_t((sum[1] + count / 2) / count);
+			res.b = uint8_t((sum[2] + count / 2) / count);
+			return res;
+		};
+
 		uint8_t r;
 		uint8_t g;
 		uint8_t b;
@@ -137,12 +153,58 @@ namespace cg
 
 	struct vertex
 	{
+		static constexpr unsigned int no_texture = 0xffffffff;
+
 		float3 position;
 		float3 normal;
 		float2 texture;
 		float3 ambient;
 		float3 diffuse;
 		float3 emissive;
+		// Diffuse texture of the vertex's material in the model's texture list
+		unsigned int texture_id = no_texture;
+	};
+
+	// Attributes at a point of a triangle given by the weights of its vertices
+	inline vertex interpolate(const vertex& a, const vertex& b, const vertex& c, const float3& bary)
+	{
+		vertex result;
+		result.position = a.position * bary.x + b.position * bary.y + c.position * bary.z;
+		result.normal = a.normal * bary.x + b.normal * bary.y + c.normal * bary.z;
+		result.texture = a.texture * bary.x + b.texture * bary.y + c.texture * bary.z;
+		result.ambient = a.ambient * bary.x + b.ambient * bary.y + c.ambient * bary.z;
+		result.diffuse = a.diffuse * bary.x + b.diffuse * bary.y + c.diffuse * bary.z;
+		result.emissive = a.emissive * bary.x + b.emissive * bary.y + c.emissive * bary.z;
+		result.texture_id = a.texture_id;
+		return result;
+	}
+
+	// Part of a shared index buffer drawn as one shape, its indices are relative to `base_vertex`
+	struct draw_range
+	{
+		size_t index_offset = 0;
+		size_t index_count = 0;
+		size_t base_vertex = 0;
+	};
+
+	// Bounding box and sphere of a shape's vertices
+	struct shape_bounds
+	{
+		float3 aabb_min{0.f, 0.f, 0.f};
+		float3 aabb_max{0.f, 0.f, 0.f};
+		float3 sphere_center{0.f, 0.f, 0.f};
+		float sphere_radius = 0.f;
+	};
+
+	// Primary visibility of a pixel: which triangle of which draw covers it
+	struct visibility
+	{
+		static constexpr unsigned int invalid_id = 0xffffffff;
+
+		unsigned int draw_id = invalid_id;
+		unsigned int primitive_id = invalid_id;
+		// Perspective-correct weights of the triangle's vertices
+		float3 bary;
 	};
 
 }// namespace cg
\ No newline at end of file
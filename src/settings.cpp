@@ -25,6 +25,16 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("denoiser_iterations", "Number of a-trous denoiser passes (0 disables denoising)", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("save_aovs", "Save depth, normal, albedo, primitive ID and sample count buffers next to the result", cxxopts::value<bool>()->default_value("false"));
+	add_options("raytracing_frames", "Number of frames in a camera sequence", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("camera_theta_step", "Camera polar angle change between sequence frames", cxxopts::value<float>()->default_value("0.5"));
+	add_options("temporal_reprojection", "Reuse the previous frame accumulation in camera sequences", cxxopts::value<bool>()->default_value("false"));
+	add_options("front_to_back", "Rasterize shapes in front-to-back order", cxxopts::value<bool>()->default_value("false"));
+	add_options("visibility_shading", "Rasterize a visibility buffer and shade every pixel once", cxxopts::value<bool>()->default_value("false"));
+	add_options("msaa_samples", "Rasterizer samples per pixel: 1, 2, 4 or 8", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("parallel_frames", "Number of animation frames the rasterizer renders at once", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("lod_pixel_error", "Largest on-screen error in pixels of simplified shapes (0 disables levels of detail)", cxxopts::value<float>()->default_value("0.0"));
 	add_options("shader_path", "Path to a shader file", cxxopts::value<std::filesystem::path>()->default_value("shaders/shaders.hlsl"));
 	add_options("h,help", "Print usage");
 
@@ -47,6 +57,16 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->denoiser_iterations = result["denoiser_iterations"].as<unsigned>();
+	settings->save_aovs = result["save_aovs"].as<bool>();
+	settings->raytracing_frames = result["raytracing_frames"].as<unsigned>();
+	settings->camera_theta_step = result["camera_theta_step"].as<float>();
+	settings->temporal_reprojection = result["temporal_reprojection"].as<bool>();
+	settings->front_to_back = result["front_to_back"].as<bool>();
+	settings->visibility_shading = result["visibility_shading"].as<bool>();
+	settings->msaa_samples = result["msaa_samples"].as<unsigned>();
+	settings->parallel_frames = result["parallel_frames"].as<unsigned>();
+	settings->lod_pixel_error = result["lod_pixel_error"].as<float>();
 	settings->shader_path = result["shader_path"].as<std::filesystem::path>();
 
 	return settings;
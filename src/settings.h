@@ -27,6 +27,16 @@ namespace cg
 
 		unsigned raytracing_depth;
 		unsigned accumulation_num;
+		unsigned denoiser_iterations;
+		bool save_aovs;
+		unsigned raytracing_frames;
+		float camera_theta_step;
+		bool temporal_reprojection;
+		bool front_to_back;
+		bool visibility_shading;
+		unsigned msaa_samples;
+		unsigned parallel_frames;
+		float lod_pixel_error;
 
 		std::filesystem::path shader_path;
 	};
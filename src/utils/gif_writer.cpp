@@ -0,0 +1,90 @@
+#include "gif_writer.h"
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <gif.h>
+
+
+cg::utils::gif_writer::gif_writer(const std::filesystem::path& filepath, size_t width, size_t height, uint32_t delay, size_t ring_size)
+	: gif(std::make_unique<GifWriter>()), width(width), height(height), delay(delay)
+{
+	if (!GifBegin(gif.get(), filepath.string().c_str(), uint32_t(width), uint32_t(height), delay)) {
+		THROW_ERROR("Can't open " + filepath.string());
+	}
+
+	slots.resize(std::max(ring_size, size_t(1)));
+	for (auto& slot: slots) {
+		slot.colors.resize(width * height);
+		slot.rgba.resize(width * height * 4);
+	}
+	encoder = std::thread(&gif_writer::encode_frames, this);
+}
+
+cg::utils::gif_writer::~gif_writer()
+{
+	finish();
+}
+
+void cg::utils::gif_writer::write_frame(cg::resource<cg::unsigned_color>& frame)
+{
+	if (frame.count() != width * height) {
+		THROW_ERROR("Frame size doesn't match the GIF size");
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (finished) {
+		THROW_ERROR("Can't write a frame after the GIF is finished");
+	}
+	slot_freed.wait(lock, [&] { return queued < slots.size(); });
+	frame_slot& slot = slots[next_write];
+	lock.unlock();
+
+	// The encoder never touches a slot until it is queued, so the copy runs unlocked
+	std::copy_n(frame.get_data(), width * height, slot.colors.begin());
+
+	lock.lock();
+	next_write = (next_write + 1) % slots.size();
+	++queued;
+	frame_queued.notify_one();
+}
+
+void cg::utils::gif_writer::finish()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (finished) {
+			return;
+		}
+		finished = true;
+	}
+	frame_queued.notify_one();
+	encoder.join();
+	GifEnd(gif.get());
+}
+
+void cg::utils::gif_writer::encode_frames()
+{
+	while (true) {
+		std::unique_lock<std::mutex> lock(mutex);
+		frame_queued.wait(lock, [&] { return queued > 0 || finished; });
+		if (queued == 0) {
+			return;
+		}
+		frame_slot& slot = slots[next_encode];
+		lock.unlock();
+
+		for (size_t i = 0; i < slot.colors.size(); ++i) {
+			slot.rgba[4 * i] = slot.colors[i].r;
+			slot.rgba[4 * i + 1] = slot.colors[i].g;
+			slot.rgba[4 * i + 2] = slot.colors[i].b;
+			slot.rgba[4 * i + 3] = 255;
+		}
+		GifWriteFrame(gif.get(), slot.rgba.data(), uint32_t(width), uint32_t(height), delay);
+
+		lock.lock();
+		next_encode = (next_encode + 1) % slots.size();
+		--queued;
+		slot_freed.notify_one();
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "resource.h"
+
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+struct GifWriter;
+
+namespace cg::utils
+{
+	// Animated GIF output that converts and encodes frames on a background thread.
+	// Frames are copied into a small ring of reusable slots, so the caller only waits
+	// when every slot is still queued for encoding.
+	class gif_writer
+	{
+	public:
+		gif_writer(const std::filesystem::path& filepath, size_t width, size_t height, uint32_t delay, size_t ring_size = 3);
+		virtual ~gif_writer();
+
+		void write_frame(cg::resource<cg::unsigned_color>& frame);
+		// Waits for the queued frames and closes the file
+		void finish();
+
+	protected:
+		struct frame_slot
+		{
+			std::vector<cg::unsigned_color> colors;
+			std::vector<uint8_t> rgba;
+		};
+
+		std::unique_ptr<GifWriter> gif;
+		size_t width;
+		size_t height;
+		uint32_t delay;
+
+		std::vector<frame_slot> slots;
+		size_t next_write = 0;
+		size_t next_encode = 0;
+		size_t queued = 0;
+		bool finished = false;
+
+		std::mutex mutex;
+		std::condition_variable slot_freed;
+		std::condition_variable frame_queued;
+		std::thread encoder;
+
+		void encode_frames();
+	};
+}// namespace cg::utils
@@ -5,7 +5,9 @@
 
 #include "utils/error_handler.h"
 
+#include <fstream>
 #include <stb_image_write.h>
+#include <type_traits>
 
 
 using namespace cg::utils;
@@ -38,3 +40,53 @@ void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, s
 		std::system(command.c_str());
 }
 
+
+template<typename T>
+static void write_pfm(cg::resource<T>& buffer, const std::filesystem::path& filepath, size_t channels)
+{
+	size_t width = buffer.get_stride();
+	size_t height = buffer.count() / width;
+
+	std::ofstream file(filepath, std::ios::binary);
+	if (!file)
+		THROW_ERROR("Can't save the resource");
+
+	// Negative scale marks little-endian data, rows go from bottom to top
+	file << (channels == 3 ? "PF" : "Pf") << "\n"
+		 << width << " " << height << "\n"
+		 << "-1.0\n";
+
+	std::vector<float> row(width * channels);
+	for (size_t y = height; y-- > 0;) {
+		for (size_t x = 0; x < width; ++x) {
+			const T& value = buffer.item(x, y);
+			if constexpr (std::is_same_v<T, float3>) {
+				row[3 * x] = value.x;
+				row[3 * x + 1] = value.y;
+				row[3 * x + 2] = value.z;
+			}
+			else {
+				row[x] = float(value);
+			}
+		}
+		file.write(reinterpret_cast<const char*>(row.data()), std::streamsize(row.size() * sizeof(float)));
+	}
+
+	if (!file)
+		THROW_ERROR("Can't save the resource");
+}
+
+void cg::utils::save_resource(cg::resource<float>& buffer, std::filesystem::path filepath)
+{
+	write_pfm(buffer, filepath, 1);
+}
+
+void cg::utils::save_resource(cg::resource<float3>& buffer, std::filesystem::path filepath)
+{
+	write_pfm(buffer, filepath, 3);
+}
+
+void cg::utils::save_resource(cg::resource<unsigned int>& buffer, std::filesystem::path filepath)
+{
+	write_pfm(buffer, filepath, 1);
+}
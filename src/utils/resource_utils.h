@@ -8,4 +8,10 @@
 namespace cg::utils
 {
 	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath);
+
+	// Float buffers are written as PFM, so values outside [0, 1] survive for compositing
+	void save_resource(cg::resource<float>& buffer, std::filesystem::path filepath);
+	void save_resource(cg::resource<float3>& buffer, std::filesystem::path filepath);
+	// Ids go through float, so values above 2^24 are rounded
+	void save_resource(cg::resource<unsigned int>& buffer, std::filesystem::path filepath);
 }
\ No newline at end of file
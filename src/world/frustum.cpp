@@ -0,0 +1,73 @@
+#include "frustum.h"
+
+
+using namespace cg::world;
+
+cg::world::frustum::frustum() {}
+
+cg::world::frustum::~frustum() {}
+
+frustum cg::world::frustum::from_matrix(const float4x4& matrix)
+{
+	// Clip space is -w <= x, y <= w and 0 <= z <= w, every bound is a combination of matrix rows
+	auto row = [&](int i) {
+		return float4{matrix[0][i], matrix[1][i], matrix[2][i], matrix[3][i]};
+	};
+	float4 x = row(0);
+	float4 y = row(1);
+	float4 z = row(2);
+	float4 w = row(3);
+
+	frustum result;
+	result.add_plane(w + x);
+	result.add_plane(w - x);
+	result.add_plane(w + y);
+	result.add_plane(w - y);
+	result.add_plane(z);
+	result.add_plane(w - z);
+	return result;
+}
+
+frustum cg::world::frustum::from_corners(const float3& origin, const float3 (&corners)[4])
+{
+	float3 center = corners[0] + corners[1] + corners[2] + corners[3];
+
+	frustum result;
+	for (size_t i = 0; i < 4; ++i) {
+		float3 normal = cross(corners[i], corners[(i + 1) % 4]);
+		// The winding of the corners is unknown, the centre ray is inside either way
+		if (dot(normal, center) < 0.f) {
+			normal = -normal;
+		}
+		result.add_plane(float4{normal, -dot(normal, origin)});
+	}
+	return result;
+}
+
+bool cg::world::frustum::intersects(const cg::shape_bounds& bounds) const
+{
+	for (const auto& plane: planes) {
+		float3 normal = plane.xyz();
+		if (dot(normal, bounds.sphere_center) + plane.w < -bounds.sphere_radius) {
+			return false;
+		}
+		// The box corner furthest along the normal is the last one to leave the plane
+		float3 corner{
+				normal.x >= 0.f ? bounds.aabb_max.x : bounds.aabb_min.x,
+				normal.y >= 0.f ? bounds.aabb_max.y : bounds.aabb_min.y,
+				normal.z >= 0.f ? bounds.aabb_max.z : bounds.aabb_min.z};
+		if (dot(normal, corner) + plane.w < 0.f) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void cg::world::frustum::add_plane(const float4& plane)
+{
+	// Unit normals make the plane distance comparable with the sphere radius
+	float normal_length = length(plane.xyz());
+	if (normal_length > 0.f) {
+		planes.push_back(plane / normal_length);
+	}
+}
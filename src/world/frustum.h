@@ -0,0 +1,34 @@
+#pragma once
+
+#include "resource.h"
+
+#include <linalg.h>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::world
+{
+	// Convex volume bounded by inward-facing planes: a point `p` is inside a plane
+	// when `dot(plane.xyz, p) + plane.w >= 0`.
+	class frustum
+	{
+	public:
+		frustum();
+		virtual ~frustum();
+
+		// Clip-space volume of a projection, bounds are tested in the space the matrix transforms from
+		static frustum from_matrix(const float4x4& matrix);
+		// Pyramid without near and far planes from `origin` through the image corners, in order around the image
+		static frustum from_corners(const float3& origin, const float3 (&corners)[4]);
+
+		// Conservative: may accept bounds that are outside near the frustum's edges
+		bool intersects(const cg::shape_bounds& bounds) const;
+
+	protected:
+		std::vector<float4> planes;
+
+		void add_plane(const float4& plane);
+	};
+}// namespace cg::world
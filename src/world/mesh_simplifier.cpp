@@ -0,0 +1,225 @@
+#include "mesh_simplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+
+using namespace cg::world;
+
+cg::world::mesh_simplifier::mesh_simplifier(std::vector<float3> in_positions, std::vector<unsigned int> in_indices)
+	: positions(std::move(in_positions)), indices(std::move(in_indices))
+{
+	quadrics.resize(positions.size());
+	locked.resize(positions.size(), 0);
+
+	// Every vertex starts with the planes of its triangles, weighted by their area
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		const float3& a = positions[indices[i]];
+		const float3& b = positions[indices[i + 1]];
+		const float3& c = positions[indices[i + 2]];
+		float3 normal = cross(b - a, c - a);
+		float double_area = length(normal);
+		if (double_area == 0.f) {
+			continue;
+		}
+		normal /= double_area;
+		for (size_t corner = 0; corner < 3; ++corner) {
+			quadrics[indices[i + corner]].add_plane(normal, -dot(normal, a), 0.5 * double_area);
+		}
+	}
+}
+
+cg::world::mesh_simplifier::~mesh_simplifier() {}
+
+bool cg::world::mesh_simplifier::simplify(size_t target_triangles)
+{
+	bool simplified = false;
+	while (get_triangle_count() > target_triangles && collapse_pass(target_triangles)) {
+		simplified = true;
+	}
+	return simplified;
+}
+
+const std::vector<unsigned int>& cg::world::mesh_simplifier::get_indices() const
+{
+	return indices;
+}
+
+size_t cg::world::mesh_simplifier::get_triangle_count() const
+{
+	return indices.size() / 3;
+}
+
+float cg::world::mesh_simplifier::get_error() const
+{
+	return error;
+}
+
+bool cg::world::mesh_simplifier::collapse_pass(size_t target_triangles)
+{
+	lock_borders();
+
+	const size_t num_triangles = get_triangle_count();
+	std::vector<unsigned int> triangle_offsets(positions.size() + 1, 0);
+	for (unsigned int index: indices) {
+		++triangle_offsets[index + 1];
+	}
+	for (size_t i = 0; i < positions.size(); ++i) {
+		triangle_offsets[i + 1] += triangle_offsets[i];
+	}
+	std::vector<unsigned int> vertex_triangles(indices.size());
+	std::vector<unsigned int> fill = triangle_offsets;
+	for (size_t i = 0; i < indices.size(); ++i) {
+		vertex_triangles[fill[indices[i]]++] = unsigned(i / 3);
+	}
+
+	// Interior edges show up once in each direction, only unlocked ends can move
+	std::vector<collapse> collapses;
+	for (size_t i = 0; i < indices.size(); ++i) {
+		unsigned int from = indices[i];
+		unsigned int to = indices[i % 3 == 2 ? i - 2 : i + 1];
+		if (locked[from] || from == to) {
+			continue;
+		}
+		quadric sum = quadrics[from];
+		sum += quadrics[to];
+		double squared = sum.weight > 0.0 ? std::max(sum.evaluate(positions[to]), 0.0) / sum.weight : 0.0;
+		collapses.push_back(collapse{from, to, float(std::sqrt(squared))});
+	}
+	std::sort(collapses.begin(), collapses.end(), [](const collapse& a, const collapse& b) {
+		return a.error < b.error;
+	});
+
+	// Collapses in one pass never share a one-ring, so their flip checks stay valid
+	std::vector<unsigned int> remap(positions.size());
+	for (unsigned int i = 0; i < remap.size(); ++i) {
+		remap[i] = i;
+	}
+	std::vector<char> touched(positions.size(), 0);
+	size_t removed = 0;
+	for (const auto& candidate: collapses) {
+		if (num_triangles - removed <= target_triangles) {
+			break;
+		}
+		if (touched[candidate.from] || touched[candidate.to]) {
+			continue;
+		}
+
+		bool valid = true;
+		size_t shared = 0;
+		for (unsigned int i = triangle_offsets[candidate.from]; i < triangle_offsets[candidate.from + 1] && valid; ++i) {
+			const unsigned int* triangle = &indices[3 * vertex_triangles[i]];
+			if (triangle[0] == candidate.to || triangle[1] == candidate.to || triangle[2] == candidate.to) {
+				++shared;
+			}
+			else {
+				valid = !flips(candidate.from, candidate.to, triangle);
+			}
+		}
+		if (!valid) {
+			continue;
+		}
+
+		remap[candidate.from] = candidate.to;
+		quadrics[candidate.to] += quadrics[candidate.from];
+		error = std::max(error, candidate.error);
+		removed += shared;
+		for (unsigned int i = triangle_offsets[candidate.from]; i < triangle_offsets[candidate.from + 1]; ++i) {
+			const unsigned int* triangle = &indices[3 * vertex_triangles[i]];
+			touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+		}
+	}
+	if (removed == 0) {
+		return false;
+	}
+
+	std::vector<unsigned int> simplified;
+	simplified.reserve(indices.size() - 3 * removed);
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		unsigned int a = remap[indices[i]];
+		unsigned int b = remap[indices[i + 1]];
+		unsigned int c = remap[indices[i + 2]];
+		if (a != b && b != c && c != a) {
+			simplified.insert(simplified.end(), {a, b, c});
+		}
+	}
+	indices = std::move(simplified);
+	return true;
+}
+
+void cg::world::mesh_simplifier::lock_borders()
+{
+	// An edge used by one triangle is a border, by more than two a non-manifold fan
+	std::vector<uint64_t> edges;
+	edges.reserve(indices.size());
+	for (size_t i = 0; i < indices.size(); ++i) {
+		uint64_t a = indices[i];
+		uint64_t b = indices[i % 3 == 2 ? i - 2 : i + 1];
+		edges.push_back(std::min(a, b) << 32 | std::max(a, b));
+	}
+	std::sort(edges.begin(), edges.end());
+	for (size_t begin = 0; begin < edges.size();) {
+		size_t end = begin + 1;
+		while (end < edges.size() && edges[end] == edges[begin]) {
+			++end;
+		}
+		if (end - begin != 2) {
+			locked[edges[begin] >> 32] = 1;
+			locked[edges[begin] & 0xffffffff] = 1;
+		}
+		begin = end;
+	}
+}
+
+bool cg::world::mesh_simplifier::flips(unsigned int from, unsigned int to, const unsigned int* triangle) const
+{
+	float3 corners[3];
+	for (size_t i = 0; i < 3; ++i) {
+		corners[i] = positions[triangle[i]];
+	}
+	float3 before = cross(corners[1] - corners[0], corners[2] - corners[0]);
+	for (size_t i = 0; i < 3; ++i) {
+		if (triangle[i] == from) {
+			corners[i] = positions[to];
+		}
+	}
+	float3 after = cross(corners[1] - corners[0], corners[2] - corners[0]);
+
+	// Turning by more than about 75 degrees or collapsing to a line counts as a flip
+	return dot(before, after) <= 0.25f * length(before) * length(after);
+}
+
+void cg::world::mesh_simplifier::quadric::add_plane(const float3& normal, float distance, double plane_weight)
+{
+	const double plane[4] = {normal.x, normal.y, normal.z, distance};
+	size_t element = 0;
+	for (size_t row = 0; row < 4; ++row) {
+		for (size_t column = row; column < 4; ++column) {
+			a[element++] += plane_weight * plane[row] * plane[column];
+		}
+	}
+	weight += plane_weight;
+}
+
+cg::world::mesh_simplifier::quadric& cg::world::mesh_simplifier::quadric::operator+=(const quadric& other)
+{
+	for (size_t i = 0; i < 10; ++i) {
+		a[i] += other.a[i];
+	}
+	weight += other.weight;
+	return *this;
+}
+
+double cg::world::mesh_simplifier::quadric::evaluate(const float3& position) const
+{
+	const double point[4] = {position.x, position.y, position.z, 1.0};
+	double result = 0.0;
+	size_t element = 0;
+	for (size_t row = 0; row < 4; ++row) {
+		for (size_t column = row; column < 4; ++column) {
+			result += (row == column ? 1.0 : 2.0) * a[element++] * point[row] * point[column];
+		}
+	}
+	return result;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <linalg.h>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::world
+{
+	// Quadric error metric simplification with half-edge collapses: a vertex only moves onto
+	// one of its neighbours, so every level indexes the original vertex buffer. Vertices on
+	// open borders, which include attribute seams of split vertices, never move.
+	class mesh_simplifier
+	{
+	public:
+		mesh_simplifier(std::vector<float3> in_positions, std::vector<unsigned int> in_indices);
+		virtual ~mesh_simplifier();
+
+		// Collapses edges until at most `target_triangles` remain, false if nothing could collapse
+		bool simplify(size_t target_triangles);
+
+		const std::vector<unsigned int>& get_indices() const;
+		size_t get_triangle_count() const;
+		// Largest RMS distance of a moved vertex to the area-weighted planes it absorbed, in model units
+		float get_error() const;
+
+	protected:
+		struct quadric
+		{
+			// Upper triangle of the symmetric 4x4 matrix
+			double a[10] = {};
+			double weight = 0.0;
+
+			void add_plane(const float3& normal, float distance, double plane_weight);
+			quadric& operator+=(const quadric& other);
+			double evaluate(const float3& position) const;
+		};
+
+		struct collapse
+		{
+			unsigned int from;
+			unsigned int to;
+			float error;
+		};
+
+		std::vector<float3> positions;
+		std::vector<unsigned int> indices;
+		std::vector<quadric> quadrics;
+		std::vector<char> locked;
+		float error = 0.f;
+
+		bool collapse_pass(size_t target_triangles);
+		void lock_borders();
+		bool flips(unsigned int from, unsigned int to, const unsigned int* triangle) const;
+	};
+}// namespace cg::world
@@ -3,7 +3,10 @@
 #include "model.h"
 
 #include "utils/error_handler.h"
+#include "world/mesh_simplifier.h"
 
+#include <algorithm>
+#include <cctype>
 #include <iostream>
 #include <linalg.h>
 
@@ -34,6 +37,8 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 
 	allocate_buffers(shapes);
 	fill_buffers(shapes, attrib, materials, model_path.parent_path());
+	merge_buffers();
+	compute_bounds();
 }
 
 void model::allocate_buffers(const std::vector<tinyobj::shape_t>& shapes)
@@ -140,6 +145,16 @@ void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib
 
 void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& materials, const std::filesystem::path& base_folder)
 {
+	// Texture ids are resolved once per material, on first use so textures keep their load order
+	constexpr unsigned int unresolved = cg::vertex::no_texture - 1;
+	std::vector<unsigned int> material_texture_ids(materials.size(), unresolved);
+	auto get_material_texture_id = [&](int material_id) {
+		if (material_texture_ids[material_id] == unresolved) {
+			material_texture_ids[material_id] = get_texture_id(materials[material_id], base_folder);
+		}
+		return material_texture_ids[material_id];
+	};
+
 	for (size_t s = 0; s < shapes.size(); ++s) {
 		size_t index_offset = 0;
 		unsigned int vertex_buffer_id = 0;
@@ -154,6 +169,8 @@ void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tiny
 		for (size_t f = 0; f < mesh.num_face_vertices.size(); ++f) {
 			int fv = mesh.num_face_vertices[f];
 			float3 normal;
+			const auto& material = materials[mesh.material_ids[f]];
+			const unsigned int texture_id = get_material_texture_id(mesh.material_ids[f]);
 
 			if (mesh.indices[index_offset].normal_index < 0) {
 				normal = compute_normal(attrib, mesh, index_offset);
@@ -167,9 +184,8 @@ void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tiny
 				// index_map.end() == index_map.find(idx_tuple)
 				if (0 == index_map.count(idx_tuple)) {
 					cg::vertex& vertex = vertex_buffer->item(vertex_buffer_id);
-					const auto& material = materials[mesh.material_ids[f]];
-
 					fill_vertex_data(vertex, attrib, idx, normal, material);
+					vertex.texture_id = texture_id;
 
 					index_map[idx_tuple] = vertex_buffer_id;
 					vertex_buffer_id++;
@@ -180,12 +196,146 @@ void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tiny
 			index_offset += fv;
 		}
 
-		if (!materials[mesh.material_ids[0]].diffuse_texname.empty()) {
-			textures[s] = base_folder / materials[mesh.material_ids[0]].diffuse_texname;
+		const unsigned int shape_texture_id = get_material_texture_id(mesh.material_ids[0]);
+		if (shape_texture_id != cg::vertex::no_texture) {
+			textures[s] = texture_files[shape_texture_id];
 		}
 	}
 }
 
+void model::merge_buffers()
+{
+	size_t vertex_count = 0;
+	size_t index_count = 0;
+	draw_ranges.clear();
+	shape_lods.clear();
+	for (size_t s = 0; s < vertex_buffers.size(); ++s) {
+		draw_ranges.push_back(cg::draw_range{index_count, index_buffers[s]->count(), vertex_count});
+		shape_lods.push_back({shape_lod{draw_ranges.back(), 0.f}});
+		index_count += index_buffers[s]->count();
+		if (s < lod_levels.size()) {
+			for (const auto& level: lod_levels[s]) {
+				shape_lods.back().push_back(shape_lod{cg::draw_range{index_count, level.indices.size(), vertex_count}, level.error});
+				index_count += level.indices.size();
+			}
+		}
+		vertex_count += vertex_buffers[s]->count();
+	}
+
+	// Indices stay relative to their shape, draws add the base vertex of the range
+	merged_vertex_buffer = std::make_shared<cg::resource<cg::vertex>>(vertex_count);
+	merged_index_buffer = std::make_shared<cg::resource<unsigned int>>(index_count);
+	for (size_t s = 0; s < vertex_buffers.size(); ++s) {
+		const auto& range = draw_ranges[s];
+		if (range.index_count == 0) {
+			continue;
+		}
+		const cg::vertex* vertices = vertex_buffers[s]->get_data();
+		std::copy(vertices, vertices + vertex_buffers[s]->count(), &merged_vertex_buffer->item(range.base_vertex));
+		const unsigned int* indices = index_buffers[s]->get_data();
+		std::copy(indices, indices + range.index_count, &merged_index_buffer->item(range.index_offset));
+		for (size_t level = 1; level < shape_lods[s].size(); ++level) {
+			const auto& lod_indices = lod_levels[s][level - 1].indices;
+			std::copy(lod_indices.begin(), lod_indices.end(), &merged_index_buffer->item(shape_lods[s][level].range.index_offset));
+		}
+	}
+}
+
+void model::build_lods(size_t min_triangles)
+{
+	lod_levels.assign(vertex_buffers.size(), {});
+	for (size_t s = 0; s < vertex_buffers.size(); ++s) {
+		const auto& vertex_buffer = vertex_buffers[s];
+		const auto& index_buffer = index_buffers[s];
+		std::vector<float3> positions(vertex_buffer->count());
+		for (size_t i = 0; i < positions.size(); ++i) {
+			positions[i] = vertex_buffer->item(i).position;
+		}
+		std::vector<unsigned int> indices(index_buffer->get_data(), index_buffer->get_data() + index_buffer->count());
+
+		mesh_simplifier simplifier(std::move(positions), std::move(indices));
+		size_t triangles = simplifier.get_triangle_count();
+		while (triangles > min_triangles) {
+			simplifier.simplify(std::max(triangles / 2, min_triangles));
+			// Locked borders stop the simplifier early, a level that barely shrinks only costs memory
+			if (simplifier.get_triangle_count() > triangles * 3 / 4) {
+				break;
+			}
+			triangles = simplifier.get_triangle_count();
+			lod_levels[s].push_back(lod_level{simplifier.get_indices(), simplifier.get_error()});
+		}
+	}
+	merge_buffers();
+}
+
+void model::compute_bounds()
+{
+	shape_bounds.clear();
+	for (const auto& vertex_buffer: vertex_buffers) {
+		cg::shape_bounds bounds;
+		if (vertex_buffer->count() == 0) {
+			shape_bounds.push_back(bounds);
+			continue;
+		}
+
+		bounds.aabb_min = bounds.aabb_max = vertex_buffer->item(0).position;
+		for (size_t i = 1; i < vertex_buffer->count(); ++i) {
+			bounds.aabb_min = min(bounds.aabb_min, vertex_buffer->item(i).position);
+			bounds.aabb_max = max(bounds.aabb_max, vertex_buffer->item(i).position);
+		}
+		// Centred on the box, tighter than its half diagonal for most meshes
+		bounds.sphere_center = (bounds.aabb_min + bounds.aabb_max) * 0.5f;
+		for (size_t i = 0; i < vertex_buffer->count(); ++i) {
+			bounds.sphere_radius = std::max(bounds.sphere_radius, length(vertex_buffer->item(i).position - bounds.sphere_center));
+		}
+		shape_bounds.push_back(bounds);
+	}
+}
+
+unsigned int model::get_texture_id(const tinyobj::material_t& material, const std::filesystem::path& base_folder)
+{
+	if (material.diffuse_texname.empty()) {
+		return cg::vertex::no_texture;
+	}
+
+	auto path = base_folder / material.diffuse_texname;
+	auto found = std::find(texture_files.begin(), texture_files.end(), path);
+	if (found == texture_files.end()) {
+		texture_files.push_back(path);
+		return unsigned(texture_files.size() - 1);
+	}
+	return unsigned(found - texture_files.begin());
+}
+
+void model::load_textures()
+{
+	loaded_textures.clear();
+	for (const auto& path: texture_files) {
+		auto loaded = std::make_shared<texture>();
+		loaded->load(find_file(path));
+		loaded_textures.push_back(loaded);
+	}
+}
+
+std::filesystem::path model::find_file(const std::filesystem::path& path)
+{
+	// Material libraries are often written on case-insensitive file systems
+	if (std::filesystem::exists(path) || !std::filesystem::is_directory(path.parent_path())) {
+		return path;
+	}
+
+	auto lower = [](std::string name) {
+		std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+		return name;
+	};
+	auto name = lower(path.filename().string());
+	for (const auto& entry: std::filesystem::directory_iterator(path.parent_path())) {
+		if (lower(entry.path().filename().string()) == name) {
+			return entry.path();
+		}
+	}
+	return path;
+}
 
 const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>&
 cg::world::model::get_vertex_buffers() const
@@ -205,6 +355,37 @@ const std::vector<std::filesystem::path>& cg::world::model::get_per_shape_textur
 }
 
 
+const std::vector<std::shared_ptr<texture>>& cg::world::model::get_textures() const
+{
+	return loaded_textures;
+}
+
+const std::shared_ptr<cg::resource<cg::vertex>>& cg::world::model::get_merged_vertex_buffer() const
+{
+	return merged_vertex_buffer;
+}
+
+const std::shared_ptr<cg::resource<unsigned int>>& cg::world::model::get_merged_index_buffer() const
+{
+	return merged_index_buffer;
+}
+
+const std::vector<cg::draw_range>& cg::world::model::get_draw_ranges() const
+{
+	return draw_ranges;
+}
+
+const std::vector<cg::shape_bounds>& cg::world::model::get_shape_bounds() const
+{
+	return shape_bounds;
+}
+
+const std::vector<std::vector<shape_lod>>& cg::world::model::get_shape_lods() const
+{
+	return shape_lods;
+}
+
+
 const float4x4 cg::world::model::get_world_matrix() const
 {
 	return float4x4{
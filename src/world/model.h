@@ -1,6 +1,7 @@
 #pragma once
 
 #include "resource.h"
+#include "world/texture.h"
 
 #include <filesystem>
 #include <linalg.h>
@@ -11,6 +12,14 @@ using namespace linalg::aliases;
 
 namespace cg::world
 {
+	// One level of detail of a shape: a range of the merged index pool over the shape's own vertices
+	struct shape_lod
+	{
+		cg::draw_range range;
+		// How far the simplified surface may be from the full shape, in model units
+		float error = 0.f;
+	};
+
 	class model
 	{
 	public:
@@ -23,6 +32,23 @@ namespace cg::world
 		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_index_buffers() const;
 		const std::vector<std::filesystem::path>& get_per_shape_texture_files() const;
 
+		// Diffuse textures indexed by `vertex::texture_id`, empty until `load_textures`
+		void load_textures();
+		const std::vector<std::shared_ptr<texture>>& get_textures() const;
+
+		// All shapes packed into one vertex and one index pool, shape `i` is `get_draw_ranges()[i]`
+		const std::shared_ptr<cg::resource<cg::vertex>>& get_merged_vertex_buffer() const;
+		const std::shared_ptr<cg::resource<unsigned int>>& get_merged_index_buffer() const;
+		const std::vector<cg::draw_range>& get_draw_ranges() const;
+		// Object-space bounds of every shape, computed at load time
+		const std::vector<cg::shape_bounds>& get_shape_bounds() const;
+
+		// Simplifies every shape into levels with half the triangles of the previous one, down to
+		// about `min_triangles`. Coarser levels are appended to the merged index pool.
+		void build_lods(size_t min_triangles = 32);
+		// Level 0 is `get_draw_ranges()[i]`, it is the only level until `build_lods`
+		const std::vector<std::vector<shape_lod>>& get_shape_lods() const;
+
 		const float4x4 get_world_matrix() const;
 
 	protected:
@@ -30,10 +56,29 @@ namespace cg::world
 		std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffers;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::filesystem::path> textures;
+		std::vector<std::filesystem::path> texture_files;
+		std::vector<std::shared_ptr<texture>> loaded_textures;
+
+		std::shared_ptr<cg::resource<cg::vertex>> merged_vertex_buffer;
+		std::shared_ptr<cg::resource<unsigned int>> merged_index_buffer;
+		std::vector<cg::draw_range> draw_ranges;
+		std::vector<cg::shape_bounds> shape_bounds;
+
+		struct lod_level
+		{
+			std::vector<unsigned int> indices;
+			float error;
+		};
+		std::vector<std::vector<lod_level>> lod_levels;
+		std::vector<std::vector<shape_lod>> shape_lods;
 
 		void allocate_buffers(const std::vector<tinyobj::shape_t>& shapes);
 		static float3 compute_normal(const tinyobj::attrib_t& attrib, const tinyobj::mesh_t& mesh, size_t index_offset);
 		static void fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, tinyobj::index_t idx, float3 computed_normal, tinyobj::material_t material);
 		void fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& materials, const std::filesystem::path& base_folder);
+		void merge_buffers();
+		void compute_bounds();
+		unsigned int get_texture_id(const tinyobj::material_t& material, const std::filesystem::path& base_folder);
+		static std::filesystem::path find_file(const std::filesystem::path& path);
 	};
 }// namespace cg::world
\ No newline at end of file
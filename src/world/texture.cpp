@@ -0,0 +1,157 @@
+#define STB_IMAGE_IMPLEMENTATION
+
+#include "texture.h"
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stb_image.h>
+
+
+using namespace linalg::aliases;
+using namespace cg::world;
+
+cg::world::texture::texture() {}
+
+cg::world::texture::~texture() {}
+
+void cg::world::texture::load(const std::filesystem::path& texture_path)
+{
+	int width, height, channels;
+	unsigned char* image = stbi_load(texture_path.string().c_str(), &width, &height, &channels, STBI_rgb_alpha);
+	if (image == nullptr) {
+		THROW_ERROR("Can't load texture " + texture_path.string());
+	}
+
+	levels.clear();
+	levels.push_back(allocate_level(width, height));
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			const unsigned char* texel = image + 4 * (size_t(y) * width + x);
+			levels[0].texels[get_texel_index(levels[0], x, y)] =
+					uint32_t(texel[0]) | (uint32_t(texel[1]) << 8) | (uint32_t(texel[2]) << 16) | (uint32_t(texel[3]) << 24);
+		}
+	}
+	stbi_image_free(image);
+
+	// Every level is a 2x2 box filter of the previous one, odd edges repeat their last texel
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		const mip_level& source = levels.back();
+		mip_level level = allocate_level(std::max(source.width / 2, 1), std::max(source.height / 2, 1));
+		for (int y = 0; y < level.height; ++y) {
+			for (int x = 0; x < level.width; ++x) {
+				uint32_t sum[4] = {0, 0, 0, 0};
+				for (int i = 0; i < 4; ++i) {
+					int source_x = std::min(2 * x + (i & 1), source.width - 1);
+					int source_y = std::min(2 * y + (i >> 1), source.height - 1);
+					uint32_t texel = source.texels[get_texel_index(source, source_x, source_y)];
+					for (int channel = 0; channel < 4; ++channel) {
+						sum[channel] += (texel >> (8 * channel)) & 0xFF;
+					}
+				}
+				uint32_t texel = 0;
+				for (int channel = 0; channel < 4; ++channel) {
+					texel |= ((sum[channel] + 2) / 4) << (8 * channel);
+				}
+				level.texels[get_texel_index(level, x, y)] = texel;
+			}
+		}
+		levels.push_back(std::move(level));
+	}
+}
+
+float3 cg::world::texture::sample(float2 uv, float lod) const
+{
+	if (levels.empty()) {
+		return float3{1.f, 1.f, 1.f};
+	}
+
+	lod = std::clamp(lod, 0.f, float(levels.size() - 1));
+	size_t level = size_t(lod);
+	float3 result = sample_bilinear(levels[level], uv);
+	float fraction = lod - float(level);
+	if (fraction > 0.f && level + 1 < levels.size()) {
+		result = lerp(result, sample_bilinear(levels[level + 1], uv), fraction);
+	}
+	return result;
+}
+
+float cg::world::texture::get_lod(float2 duv_dx, float2 duv_dy) const
+{
+	if (levels.empty()) {
+		return 0.f;
+	}
+
+	// The longer axis of the pixel footprint in texels selects the level
+	float2 size{float(levels[0].width), float(levels[0].height)};
+	float footprint = std::max(length2(duv_dx * size), length2(duv_dy * size));
+	return footprint > 0.f ? 0.5f * std::log2(footprint) : 0.f;
+}
+
+size_t cg::world::texture::get_width() const
+{
+	return levels.empty() ? 0 : size_t(levels[0].width);
+}
+
+size_t cg::world::texture::get_height() const
+{
+	return levels.empty() ? 0 : size_t(levels[0].height);
+}
+
+texture::mip_level cg::world::texture::allocate_level(int width, int height)
+{
+	mip_level level;
+	level.width = width;
+	level.height = height;
+	level.tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+	level.texels.resize(size_t(level.tiles_x) * tiles_y * tile_size * tile_size);
+	return level;
+}
+
+size_t cg::world::texture::get_texel_index(const mip_level& level, int x, int y)
+{
+	// Interleaves the low bits of x and y
+	auto spread = [](unsigned int value) {
+		value = (value | (value << 2)) & 0x33;
+		value = (value | (value << 1)) & 0x55;
+		return value;
+	};
+	size_t tile = size_t(y >> tile_bits) * level.tiles_x + (x >> tile_bits);
+	unsigned int mask = tile_size - 1;
+	return (tile << (2 * tile_bits)) + (spread(unsigned(x) & mask) | (spread(unsigned(y) & mask) << 1));
+}
+
+float3 cg::world::texture::unpack(uint32_t texel)
+{
+	return float3{float(texel & 0xFF), float((texel >> 8) & 0xFF), float((texel >> 16) & 0xFF)} / 255.f;
+}
+
+float3 cg::world::texture::sample_bilinear(const mip_level& level, float2 uv) const
+{
+	// Images are stored top row first
+	float x = uv.x * float(level.width) - 0.5f;
+	float y = (1.f - uv.y) * float(level.height) - 0.5f;
+	float x_floor = std::floor(x);
+	float y_floor = std::floor(y);
+	float fraction_x = x - x_floor;
+	float fraction_y = y - y_floor;
+
+	auto wrap = [](float coordinate, int size) {
+		int value = int(std::fmod(coordinate, float(size)));
+		return value < 0 ? value + size : value;
+	};
+	int x0 = wrap(x_floor, level.width);
+	int y0 = wrap(y_floor, level.height);
+	int x1 = x0 + 1 < level.width ? x0 + 1 : 0;
+	int y1 = y0 + 1 < level.height ? y0 + 1 : 0;
+
+	float3 top = lerp(
+			unpack(level.texels[get_texel_index(level, x0, y0)]),
+			unpack(level.texels[get_texel_index(level, x1, y0)]), fraction_x);
+	float3 bottom = lerp(
+			unpack(level.texels[get_texel_index(level, x0, y1)]),
+			unpack(level.texels[get_texel_index(level, x1, y1)]), fraction_x);
+	return lerp(top, bottom, fraction_y);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <linalg.h>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::world
+{
+	// RGB texture with a full mip chain, sampled with wrapping and trilinear filtering.
+	// Every level is split into 8x8 tiles with texels in Morton order inside a tile,
+	// so a bilinear footprint mostly stays within one or two cache lines.
+	class texture
+	{
+	public:
+		texture();
+		virtual ~texture();
+
+		void load(const std::filesystem::path& texture_path);
+
+		// Texture coordinates follow OBJ: `v` grows upwards
+		float3 sample(float2 uv, float lod) const;
+		// Level of detail for texture coordinate differences to the next pixel in x and y
+		float get_lod(float2 duv_dx, float2 duv_dy) const;
+
+		size_t get_width() const;
+		size_t get_height() const;
+
+	protected:
+		static constexpr int tile_bits = 3;
+		static constexpr int tile_size = 1 << tile_bits;
+
+		struct mip_level
+		{
+			int width;
+			int height;
+			int tiles_x;
+			// Packed RGBA8
+			std::vector<uint32_t> texels;
+		};
+		std::vector<mip_level> levels;
+
+		static mip_level allocate_level(int width, int height);
+		static size_t get_texel_index(const mip_level& level, int x, int y);
+		static float3 unpack(uint32_t texel);
+		float3 sample_bilinear(const mip_level& level, float2 uv) const;
+	};
+}// namespace cg::world